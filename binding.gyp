@@ -1,16 +1,27 @@
 {
+  "variables"     : {
+                      "with_libpmta%" : "true"
+                    },
   "targets": [
     {
       "target_name"   : "pmta",
-      "sources"       : [ "src/pmta.cpp" ],
+      "sources"       : [ "src/pmta.cpp", "src/smtp.cpp",
+                          "src/accounting.cpp", "src/suppression.cpp",
+                          "src/limiter.cpp" ],
       "include_dirs"  : [ 
-                          "/opt/pmta/api/include/",
                           "<!(node -e \"require('nan')\")"
                         ],
-      "libraries"     : [ "-lpmta" ],
       "cflags"        : [ "-Wno-write-strings" ],
       "cflags!"       : [ "-fno-exceptions" ],
-      "cflags_cc!"    : [ "-fno-exceptions" ]
+      "cflags_cc!"    : [ "-fno-exceptions" ],
+      "conditions"    : [
+        [ "with_libpmta=='true'", {
+          "include_dirs"  : [ "/opt/pmta/api/include/" ],
+          "libraries"     : [ "-lpmta" ]
+        }, {
+          "defines"       : [ "PMTA_NO_LIBPMTA" ]
+        } ]
+      ]
     }
   ]
 }
@@ -26,6 +26,10 @@ exports.PmtaRcptNOTIFY_NEVER    = 0x00;
 exports.PmtaRcptNOTIFY_SUCCESS  = 0x01;
 exports.PmtaRcptNOTIFY_FAILURE  = 0x02;
 exports.PmtaRcptNOTIFY_DELAY    = 0x04;
+exports.PmtaTransportAPI        = "api";
+exports.PmtaTransportSMTP       = "smtp";
 exports.Message                 = pmta.PMTAMessage;
 exports.Recipient               = pmta.PMTARecipient;
 exports.Connection              = pmta.PMTAConnection;
+exports.AccountingReader        = pmta.PMTAAccountingReader;
+exports.SuppressionIndex        = pmta.PMTASuppressionIndex;
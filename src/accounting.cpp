@@ -0,0 +1,590 @@
+#include "accounting.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace pmta {
+namespace accounting {
+
+namespace {
+
+/*
+ * Bytes read at a time in follow mode; doubled while a single record does
+ * not fit.
+ */
+const size_t kChunk = 4 * 1024 * 1024;
+
+/*
+ * First occurrence of pA or pB in [pBegin, pEnd), or pEnd. Fields in
+ * accounting records are short, so this compares 16 bytes at a time rather
+ * than calling memchr twice per field.
+ */
+inline const char* find2 (const char* pBegin, const char* pEnd, char pA,
+  char pB) {
+  const char* p = pBegin;
+#ifdef __SSE2__
+  const __m128i a = _mm_set1_epi8(pA);
+  const __m128i b = _mm_set1_epi8(pB);
+  while (pEnd - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int mask = _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < pEnd && *p != pA && *p != pB) {
+    p++;
+  }
+  return p;
+}
+
+/*
+ * Start of the record after the one p is in, honouring quoted fields, or
+ * NULL if the record is not terminated yet.
+ */
+const char* skipRecord (const char* p, const char* pEnd) {
+  for (;;) {
+    p = find2(p, pEnd, '\n', '"');
+    if (p == pEnd) {
+      return NULL;
+    }
+    if (*p == '\n') {
+      return p + 1;
+    }
+    p = static_cast<const char*>(memchr(p + 1, '"', pEnd - p - 1));
+    if (p == NULL) {
+      return NULL;
+    }
+    p++;
+  }
+}
+
+bool equals (const Span& pSpan, const std::string& pString) {
+  return pSpan.mLength == pString.size() &&
+    memcmp(pSpan.mData, pString.data(), pSpan.mLength) == 0;
+}
+
+double parseNumber (const Span& pSpan) {
+  const char* p   = pSpan.mData;
+  const char* end = p + pSpan.mLength;
+  if (p == end) {
+    return NAN;
+  }
+
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+') {
+    p++;
+  }
+
+  double value  = 0;
+  bool   digits = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    value  = value * 10 + (*p - '0');
+    digits = true;
+  }
+  if (p < end && *p == '.') {
+    double scale = 0.1;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      value += (*p - '0') * scale;
+      scale /= 10;
+      digits = true;
+    }
+  }
+
+  if (!digits || p != end) {
+    return NAN;
+  }
+  return negative ? -value : value;
+}
+
+bool digits (const char* p, int pCount, int& pValue) {
+  pValue = 0;
+  for (int i = 0; i < pCount; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    pValue = pValue * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date. */
+int64_t daysFromCivil (int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t  era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+/*
+ * PMTA writes "2015-06-01 13:45:10-0400". A missing zone is taken as UTC;
+ * "+hh:mm" and "Z" are accepted as well.
+ */
+double parseTime (const Span& pSpan) {
+  const char* p = pSpan.mData;
+  size_t      n = pSpan.mLength;
+  int year, month, day, hour, minute, second;
+
+  if (n < 19 || !digits(p, 4, year) || p[4] != '-' ||
+      !digits(p + 5, 2, month) || p[7] != '-' || !digits(p + 8, 2, day) ||
+      (p[10] != ' ' && p[10] != 'T') || !digits(p + 11, 2, hour) ||
+      p[13] != ':' || !digits(p + 14, 2, minute) || p[16] != ':' ||
+      !digits(p + 17, 2, second) || month < 1 || month > 12) {
+    return NAN;
+  }
+
+  int64_t t = daysFromCivil(year, month, day) * 86400 +
+    hour * 3600 + minute * 60 + second;
+
+  p += 19;
+  n -= 19;
+  if (n > 0 && (*p == '+' || *p == '-')) {
+    int sign = *p == '-' ? -1 : 1;
+    int zh, zm;
+    if (n == 5 && digits(p + 1, 2, zh) && digits(p + 3, 2, zm)) {
+    } else if (n == 6 && p[3] == ':' && digits(p + 1, 2, zh) &&
+      digits(p + 4, 2, zm)) {
+    } else {
+      return NAN;
+    }
+    t -= sign * (zh * 3600 + zm * 60);
+  } else if (n > 0 && !(n == 1 && *p == 'Z')) {
+    return NAN;
+  }
+
+  return static_cast<double>(t) * 1000;
+}
+
+}
+
+/*
+ * Batch
+ */
+
+void Batch::clear (void) {
+  mRows = 0;
+  for (size_t c = 0; c < mStrings.size(); c++) {
+    mStrings[c].clear();
+  }
+  for (size_t c = 0; c < mNumbers.size(); c++) {
+    mNumbers[c].clear();
+  }
+  mUnquoted.clear();
+}
+
+/*
+ * Reader
+ */
+
+Reader::Reader (const std::string& pPath, const std::vector<Column>& pColumns,
+  const std::vector<std::string>& pTypes, bool pFollow)
+  : mPath(pPath), mColumns(pColumns), mTypes(pTypes), mFollow(pFollow),
+    mFd(-1), mDev(0), mIno(0), mMap(NULL), mMapped(0), mData(NULL),
+    mLength(0), mBase(0), mOffset(0), mDone(false), mLastField(0) {
+}
+
+Reader::~Reader (void) {
+  close();
+}
+
+bool Reader::read (Batch& pBatch, size_t pMaxRows) {
+  pBatch.mStrings.resize(mColumns.size());
+  pBatch.mNumbers.resize(mColumns.size());
+  pBatch.clear();
+
+  if (mDone || pMaxRows == 0) {
+    return false;
+  }
+  if (mFd < 0 && !open()) {
+    return false;
+  }
+
+  uint64_t length = size();
+  if (length < mOffset) {
+    // Truncated in place (copytruncate); start over.
+    mOffset = 0;
+    mLength = 0;
+    mFields.clear();
+    mLastField = 0;
+  }
+
+  if (consume(pBatch, pMaxRows, length, !mFollow) > 0) {
+    return true;
+  }
+  if (!mFollow) {
+    mDone = true;
+    return false;
+  }
+  if (!rotated()) {
+    return false;
+  }
+
+  // The path now names a new file and nothing more will be appended to the
+  // one we hold: take its unterminated last record, if any, then move on.
+  if (consume(pBatch, pMaxRows, length, true) > 0) {
+    return true;
+  }
+  unmap();
+  ::close(mFd);
+  mFd = -1;
+
+  if (!open()) {
+    return false;
+  }
+  return consume(pBatch, pMaxRows, size(), false) > 0;
+}
+
+void Reader::close (void) {
+  unmap();
+  std::vector<char>().swap(mBuffer);
+  mData   = NULL;
+  mLength = 0;
+  if (mFd >= 0) {
+    ::close(mFd);
+    mFd = -1;
+  }
+  mDone = true;
+}
+
+bool Reader::open (void) {
+  mFd = ::open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (mFd < 0) {
+    if (mFollow && errno == ENOENT) {
+      return false;
+    }
+    throw Error(mPath + ": " + strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(mFd, &st) != 0) {
+    int error = errno;
+    ::close(mFd);
+    mFd = -1;
+    throw Error(mPath + ": " + strerror(error));
+  }
+
+  mDev       = st.st_dev;
+  mIno       = st.st_ino;
+  mOffset    = 0;
+  mLength    = 0;
+  mFields.clear();
+  mLastField = 0;
+  return true;
+}
+
+uint64_t Reader::size (void) {
+  struct stat st;
+  if (fstat(mFd, &st) != 0) {
+    throw Error(mPath + ": " + strerror(errno));
+  }
+  return st.st_size;
+}
+
+/*
+ * Parses from mOffset in a file pSize bytes long, loading as much of it as
+ * it takes to return at least one record or reach the end.
+ */
+size_t Reader::consume (Batch& pBatch, size_t pMaxRows, uint64_t pSize,
+  bool pFinal) {
+  size_t chunk = kChunk;
+  for (;;) {
+    load(pSize, chunk);
+    bool whole = mBase + mLength >= pSize;
+
+    uint64_t before = mOffset;
+    size_t   rows   = parse(pBatch, pMaxRows, pFinal && whole);
+    if (rows > 0 || whole) {
+      return rows;
+    }
+    if (mOffset == before) {
+      chunk *= 2;
+    }
+  }
+}
+
+/*
+ * Makes bytes from mOffset on available at mData. A file read in one pass
+ * is mapped whole. A followed file may be truncated in place at any time,
+ * and touching a mapped page past its new end raises SIGBUS, so its unread
+ * part is copied with pread() instead, at most pChunk bytes of it. A short
+ * read means the file was truncated meanwhile; pSize is lowered to match.
+ *
+ * What is already buffered from mOffset on is kept, and only the bytes
+ * after it are read. While more than half a chunk of it is left unread
+ * nothing is read at all, so small batches do not cost a chunk each.
+ */
+void Reader::load (uint64_t& pSize, size_t pChunk) {
+  if (!mFollow) {
+    map(pSize);
+    mData   = mMap;
+    mLength = mMapped;
+    mBase   = 0;
+    return;
+  }
+
+  uint64_t end = mBase + mLength;
+  size_t kept = 0;
+  if (mOffset >= mBase && mOffset < end && end <= pSize) {
+    kept = end - mOffset;
+    if (end == pSize || kept > pChunk / 2) {
+      return;
+    }
+  }
+
+  uint64_t want = pSize > mOffset + kept ? pSize - mOffset - kept : 0;
+  if (kept + want > pChunk) {
+    want = pChunk > kept ? pChunk - kept : 0;
+  }
+
+  if (kept > 0 && mOffset > mBase) {
+    memmove(&mBuffer[0], &mBuffer[mOffset - mBase], kept);
+  }
+  if (mBuffer.size() < kept + want) {
+    mBuffer.resize(kept + want);
+  }
+
+  size_t got = 0;
+  while (got < want) {
+    ssize_t n = pread(mFd, &mBuffer[kept + got], want - got,
+      mOffset + kept + got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      throw Error(mPath + ": " + strerror(errno));
+    }
+    if (n == 0) {
+      pSize = mOffset + kept + got;
+      break;
+    }
+    got += n;
+  }
+
+  mData   = kept + got > 0 ? &mBuffer[0] : NULL;
+  mLength = kept + got;
+  mBase   = mOffset;
+}
+
+/*
+ * The whole file is mapped; if it has grown the mapping is simply replaced.
+ * Address space, not memory, is what this costs.
+ */
+void Reader::map (size_t pSize) {
+  if (pSize == mMapped) {
+    return;
+  }
+  unmap();
+  if (pSize == 0) {
+    return;
+  }
+
+  void* map = mmap(NULL, pSize, PROT_READ, MAP_SHARED, mFd, 0);
+  if (map == MAP_FAILED) {
+    throw Error(mPath + ": " + strerror(errno));
+  }
+  madvise(map, pSize, MADV_SEQUENTIAL);
+
+  mMap    = static_cast<const char*>(map);
+  mMapped = pSize;
+}
+
+void Reader::unmap (void) {
+  if (mMap != NULL) {
+    munmap(const_cast<char*>(mMap), mMapped);
+    mMap = NULL;
+  }
+  mMapped = 0;
+}
+
+bool Reader::rotated (void) {
+  struct stat st;
+  if (stat(mPath.c_str(), &st) != 0) {
+    // Renamed away and not recreated yet; keep waiting on the old file.
+    return false;
+  }
+  return st.st_dev != mDev || st.st_ino != mIno;
+}
+
+/*
+ * Parses complete records from mOffset on. Unless pFinal is set a record
+ * is only complete once its newline has been written; an incomplete one
+ * is left for the next call.
+ */
+size_t Reader::parse (Batch& pBatch, size_t pMaxRows, bool pFinal) {
+  if (mData == NULL) {
+    return 0;
+  }
+
+  const char* end = mData + mLength;
+  const char* p   = mData + (mOffset - mBase);
+
+  std::vector<Span> row(mColumns.size());
+  std::vector<Span> names;
+  size_t rows = 0;
+
+  while (rows < pMaxRows && p < end) {
+    bool complete = false;
+    bool isHeader = false;
+    bool keep     = true;
+    size_t field  = 0;
+
+    for (size_t c = 0; c < row.size(); c++) {
+      row[c].mData   = "";
+      row[c].mLength = 0;
+    }
+    names.clear();
+
+    for (;;) {
+      Span value;
+
+      if (p < end && *p == '"') {
+        const char* close   = p + 1;
+        bool        escaped = false;
+        for (;;) {
+          close = static_cast<const char*>(memchr(close, '"', end - close));
+          if (close == NULL || close + 1 >= end) {
+            break;
+          }
+          if (close[1] != '"') {
+            break;
+          }
+          escaped = true;
+          close  += 2;
+        }
+        if (close == NULL || (close + 1 == end && !pFinal)) {
+          break;
+        }
+
+        value.mData   = p + 1;
+        value.mLength = close - p - 1;
+        if (escaped) {
+          pBatch.mUnquoted.push_back(std::string());
+          std::string& unquoted = pBatch.mUnquoted.back();
+          for (const char* c = value.mData; c < close; c++) {
+            unquoted += *c;
+            if (*c == '"') {
+              c++;
+            }
+          }
+          value.mData   = unquoted.data();
+          value.mLength = unquoted.size();
+        }
+        p = find2(close + 1, end, ',', '\n');
+      } else {
+        const char* start = p;
+        p = find2(p, end, ',', '\n');
+        value.mData   = start;
+        value.mLength = p - start;
+        if (value.mLength > 0 && (p == end || *p == '\n') &&
+          start[value.mLength - 1] == '\r') {
+          value.mLength--;
+        }
+      }
+
+      if (p == end && !pFinal) {
+        break;
+      }
+      bool eol = p == end || *p++ == '\n';
+
+      if (field == 0) {
+        if (equals(value, "type")) {
+          isHeader = true;
+        } else if (mFields.empty() || (eol && value.mLength == 0)) {
+          // Until a header has been read there is nothing to map fields
+          // to, and a blank line is not a record.
+          keep = false;
+        } else if (!mTypes.empty()) {
+          keep = false;
+          for (size_t t = 0; t < mTypes.size() && !keep; t++) {
+            keep = equals(value, mTypes[t]);
+          }
+        }
+      }
+
+      if (isHeader) {
+        names.push_back(value);
+      } else if (keep && field < mFields.size() && mFields[field] >= 0) {
+        row[mFields[field]] = value;
+      }
+
+      field++;
+      if (eol) {
+        complete = true;
+        break;
+      }
+      if (!isHeader && (!keep || field > mLastField)) {
+        // Nothing else is wanted from this record.
+        const char* next = skipRecord(p, end);
+        if (next == NULL && !pFinal) {
+          break;
+        }
+        p        = next == NULL ? end : next;
+        complete = true;
+        break;
+      }
+    }
+
+    if (!complete) {
+      break;
+    }
+    mOffset = mBase + (p - mData);
+
+    if (isHeader) {
+      header(names);
+      continue;
+    }
+    if (!keep) {
+      continue;
+    }
+
+    for (size_t c = 0; c < mColumns.size(); c++) {
+      switch (mColumns[c].mType) {
+        case COLUMN_STRING:
+          pBatch.mStrings[c].push_back(row[c]);
+          break;
+        case COLUMN_NUMBER:
+          pBatch.mNumbers[c].push_back(parseNumber(row[c]));
+          break;
+        case COLUMN_TIME:
+          pBatch.mNumbers[c].push_back(parseTime(row[c]));
+          break;
+      }
+    }
+    rows++;
+  }
+
+  pBatch.mRows += rows;
+  return rows;
+}
+
+void Reader::header (const std::vector<Span>& pNames) {
+  mFields.assign(pNames.size(), -1);
+  mLastField = 0;
+
+  for (size_t f = 0; f < pNames.size(); f++) {
+    for (size_t c = 0; c < mColumns.size(); c++) {
+      if (equals(pNames[f], mColumns[c].mName)) {
+        mFields[f] = c;
+        mLastField = f;
+        break;
+      }
+    }
+  }
+}
+
+}
+}
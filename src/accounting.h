@@ -0,0 +1,178 @@
+/*! \file accounting.h Streaming reader for PMTA accounting (CSV) files.
+ *
+ * <div class="license">
+ * Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * </div>
+ */
+#ifndef PMTA_ACCOUNTING_H
+#define PMTA_ACCOUNTING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace pmta {
+namespace accounting {
+
+/*!
+ * \brief Thrown when an accounting file cannot be opened or mapped.
+ */
+class Error : public std::runtime_error {
+  public:
+    explicit Error (const std::string& pWhat) : std::runtime_error(pWhat) {}
+};
+
+enum ColumnType {
+  COLUMN_STRING,    /*!< Field text, as is */
+  COLUMN_NUMBER,    /*!< Decimal number, NaN when empty or malformed */
+  COLUMN_TIME       /*!< PMTA time stamp as ms since the epoch, or NaN */
+};
+
+/*!
+ * \addtogroup accounting PMTA accounting
+ * \brief A column to project out of the accounting records.
+ */
+struct Column {
+  Column (const std::string& pName, ColumnType pType = COLUMN_STRING)
+    : mName(pName), mType(pType) {}
+
+  std::string mName;
+  ColumnType  mType;
+};
+
+/*!
+ * \brief A field of a string column. Points into the mapped file, or into
+ *        Batch::mUnquoted for quoted fields that contained "" escapes.
+ */
+struct Span {
+  const char* mData;
+  size_t      mLength;
+};
+
+/*!
+ * \brief Up to Reader::read()'s row limit of records, stored by column.
+ *
+ * mStrings[c] is filled for string columns and mNumbers[c] for number and
+ * time columns. String spans are only valid until the next call to read().
+ */
+struct Batch {
+  size_t mRows;
+  std::vector<std::vector<Span> >   mStrings;
+  std::vector<std::vector<double> > mNumbers;
+  std::deque<std::string>           mUnquoted;
+
+  void clear (void);
+};
+
+/*!
+ * \brief Reads an accounting file.
+ *
+ * The column layout is taken from header records (those whose first field
+ * is "type"), so a single reader copes with files whose fields change
+ * between PMTA restarts. Only the requested columns are extracted and only
+ * records whose type (d, b, t, rb, ...) is listed in pTypes are returned.
+ *
+ * In follow mode the reader behaves like `tail -F`: reaching the end of the
+ * file is not final, a partial last line is held back until it is complete,
+ * and when the path is rotated (renamed or replaced) or truncated the reader
+ * finishes the old file and continues with the new one from the start.
+ *
+ * A file read in one pass is memory-mapped and must not be truncated while
+ * it is being read. A followed file is read with pread() instead, so it can
+ * safely be truncated in place at any time.
+ */
+class Reader {
+
+  public:
+    /*!
+     * \param pPath Accounting file to read
+     * \param pColumns Columns to project, in output order
+     * \param pTypes Record types to keep, e.g. "d" and "b"; empty for all
+     * \param pFollow Keep following the file past its end
+     */
+    Reader (const std::string& pPath, const std::vector<Column>& pColumns,
+      const std::vector<std::string>& pTypes, bool pFollow);
+
+    ~Reader (void);
+
+    /*!
+     * \brief Parse the next batch of records.
+     * \param pBatch Receives the records; cleared first.
+     * \param pMaxRows Largest number of records to return.
+     * \return False if no records were available. Without follow mode that
+     *         means the end of the file.
+     */
+    bool read (Batch& pBatch, size_t pMaxRows);
+
+    /*!
+     * \brief Unmap and close the file.
+     */
+    void close (void);
+
+    /*!
+     * \brief Byte offset of the next unread record in the current file.
+     */
+    uint64_t offset (void) const { return mOffset; }
+
+    const std::vector<Column>& columns (void) const { return mColumns; }
+
+  private:
+    bool open (void);
+    uint64_t size (void);
+    size_t consume (Batch& pBatch, size_t pMaxRows, uint64_t pSize,
+      bool pFinal);
+    void load (uint64_t& pSize, size_t pChunk);
+    void map (size_t pSize);
+    void unmap (void);
+    bool rotated (void);
+
+    size_t parse (Batch& pBatch, size_t pMaxRows, bool pFinal);
+    void header (const std::vector<Span>& pNames);
+
+    std::string              mPath;
+    std::vector<Column>      mColumns;
+    std::vector<std::string> mTypes;
+    bool                     mFollow;
+
+    int         mFd;
+    dev_t       mDev;
+    ino_t       mIno;
+    const char* mMap;
+    size_t      mMapped;
+
+    /* mLength bytes of the file from offset mBase, in mMap or mBuffer. */
+    std::vector<char> mBuffer;
+    const char*       mData;
+    size_t            mLength;
+    uint64_t          mBase;
+
+    uint64_t    mOffset;
+    bool        mDone;
+
+    /* mFields[f] is the output column for field f, or -1 if not wanted. */
+    std::vector<int> mFields;
+    size_t           mLastField;
+};
+
+}
+}
+
+#endif
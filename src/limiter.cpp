@@ -0,0 +1,89 @@
+#include "limiter.h"
+
+namespace pmta {
+namespace concurrency {
+
+/*
+ * How far the baseline moves towards latencies above it per limit's worth
+ * of samples, i.e. roughly per round trip whatever the limit.
+ */
+static const double kBaselineDrift = 0.001;
+
+Limiter::Limiter (const Options& pOptions)
+  : mOptions(pOptions), mLimit(pOptions.mInitial), mInFlight(0),
+    mLatency(0), mBaseline(0), mTickets(0), mRecovery(0) {
+  if (mOptions.mMin < 1) {
+    mOptions.mMin = 1;
+  }
+  if (mOptions.mMax < mOptions.mMin) {
+    mOptions.mMax = mOptions.mMin;
+  }
+  if (mLimit < mOptions.mMin) {
+    mLimit = mOptions.mMin;
+  } else if (mLimit > mOptions.mMax) {
+    mLimit = mOptions.mMax;
+  }
+}
+
+uint64_t Limiter::acquire (void) {
+  if (mInFlight >= limit()) {
+    return 0;
+  }
+  mInFlight++;
+  return ++mTickets;
+}
+
+void Limiter::release (uint64_t pTicket, double pLatency, Outcome pOutcome) {
+  // Whether the limit was what held submissions back, rather than demand.
+  bool saturated = mInFlight * 2 >= limit();
+  if (mInFlight > 0) {
+    mInFlight--;
+  }
+
+  // A ticket handed out before the last decrease measured the old limit.
+  bool current = pTicket > mRecovery;
+
+  if (pOutcome == OUTCOME_PERMANENT) {
+    return;
+  }
+  if (pOutcome == OUTCOME_TEMPORARY) {
+    if (current) {
+      decrease();
+    }
+    return;
+  }
+
+  if (mBaseline == 0) {
+    mBaseline = pLatency;
+    mLatency  = pLatency;
+  } else {
+    mLatency += (pLatency - mLatency) * mOptions.mSmoothing;
+    if (pLatency < mBaseline) {
+      mBaseline = pLatency;
+    } else {
+      mBaseline += (pLatency - mBaseline) * kBaselineDrift / mLimit;
+    }
+  }
+
+  if (mLatency > mBaseline * mOptions.mTolerance) {
+    if (current) {
+      decrease();
+    }
+  } else if (saturated && current) {
+    mLimit += 1 / mLimit;
+    if (mLimit > mOptions.mMax) {
+      mLimit = mOptions.mMax;
+    }
+  }
+}
+
+void Limiter::decrease (void) {
+  mLimit *= mOptions.mBackoff;
+  if (mLimit < mOptions.mMin) {
+    mLimit = mOptions.mMin;
+  }
+  mRecovery = mTickets;
+}
+
+}
+}
@@ -0,0 +1,110 @@
+/*! \file limiter.h Adaptive limit on concurrent submissions.
+ *
+ * <div class="license">
+ * Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * </div>
+ */
+#ifndef PMTA_LIMITER_H
+#define PMTA_LIMITER_H
+
+#include <stdint.h>
+
+namespace pmta {
+namespace concurrency {
+
+/*!
+ * \addtogroup limiter Concurrency limiter
+ * \brief Limiter settings.
+ */
+struct Options {
+  Options (void)
+    : mInitial(4), mMin(1), mMax(64), mTolerance(1.5), mBackoff(0.5),
+      mSmoothing(0.2) {}
+
+  double mInitial;     /*!< Starting limit */
+  double mMin;         /*!< The limit never drops below this */
+  double mMax;         /*!< The limit never rises above this */
+  double mTolerance;   /*!< Latency over baseline * this is congestion */
+  double mBackoff;     /*!< Limit multiplier on congestion or error */
+  double mSmoothing;   /*!< Weight of each sample in the latency average */
+};
+
+/*!
+ * \brief How a submission ended, as far as the limiter is concerned.
+ */
+enum Outcome {
+  OUTCOME_OK,         /*!< Submitted */
+  OUTCOME_TEMPORARY,  /*!< Transport failure, timeout or 4xx reply */
+  OUTCOME_PERMANENT   /*!< 5xx reply or local error, e.g. no recipients */
+};
+
+/*!
+ * \brief AIMD limit on the number of submissions in flight.
+ *
+ * Each completed submission reports its latency. The limiter keeps a
+ * smoothed latency and a baseline, the lowest latency seen, which slowly
+ * drifts up so that a lasting change in PMTA's response time becomes the
+ * new normal. While the smoothed latency stays within mTolerance times the
+ * baseline and the limit is actually being used, the limit grows by about
+ * one per limit's worth of completions. When latency rises past that, or a
+ * submission fails temporarily, the limit is multiplied by mBackoff; only
+ * once for all the submissions that were already in flight at the time, so
+ * a single slow period does not collapse the limit. Permanent failures say
+ * nothing about load and leave the limit alone.
+ *
+ * Not thread-safe; acquire() and release() are expected to be called from
+ * one thread.
+ */
+class Limiter {
+
+  public:
+    explicit Limiter (const Options& pOptions = Options());
+
+    /*!
+     * \brief Take a slot if one is free.
+     * \return A ticket to pass to release(), or 0 if the limit is reached.
+     */
+    uint64_t acquire (void);
+
+    /*!
+     * \brief Return a slot.
+     * \param pTicket Ticket returned by acquire()
+     * \param pLatency How long the submission took, in milliseconds
+     * \param pOutcome How it ended; only OUTCOME_OK latencies are sampled
+     */
+    void release (uint64_t pTicket, double pLatency, Outcome pOutcome);
+
+    unsigned limit (void) const { return static_cast<unsigned>(mLimit); }
+    unsigned inFlight (void) const { return mInFlight; }
+    double latency (void) const { return mLatency; }
+    double baseline (void) const { return mBaseline; }
+
+  private:
+    void decrease (void);
+
+    Options  mOptions;
+    double   mLimit;
+    unsigned mInFlight;
+    double   mLatency;
+    double   mBaseline;
+    uint64_t mTickets;
+    uint64_t mRecovery;
+};
+
+}
+}
+
+#endif
@@ -1,6 +1,238 @@
 #include "pmta.h"
 
+#ifndef PMTA_NO_LIBPMTA
 using namespace pmta::submitter;
+#endif
+
+/*
+ * Builds the object submit() returns and submitAsync() passes on.
+ */
+static v8::Local<v8::Object> submitResult (bool pSubmitted,
+  const std::string& pError, const std::vector<std::string>& pRejected) {
+
+  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  Nan::Set(ret, Nan::New("submitted").ToLocalChecked(), Nan::New(pSubmitted));
+
+  if (!pSubmitted) {
+    Nan::Set(ret, Nan::New("errorMessage").ToLocalChecked(), 
+      Nan::New(pError).ToLocalChecked());
+  }
+
+  if (!pRejected.empty()) {
+    v8::Local<v8::Array> list = Nan::New<v8::Array>(pRejected.size());
+    for (size_t i = 0; i < pRejected.size(); i++) {
+      Nan::Set(list, i, Nan::New(pRejected[i]).ToLocalChecked());
+    }
+    Nan::Set(ret, Nan::New("rejectedRecipients").ToLocalChecked(), list);
+  }
+  return ret;
+}
+
+#ifndef PMTA_NO_LIBPMTA
+/*
+ * Builds the libpmta message for the "api" transport from the one copy
+ * PMTAMessage keeps, replaying the data call by call so merge data stays
+ * merge data.
+ */
+static void build (const pmta::smtp::Message& pIn,
+  pmta::submitter::Message& pOut) {
+
+  if (pIn.mVerp) {
+    pOut.setVerp(true);
+  }
+  if (pIn.mEncoding == pmta::smtp::ENCODING_8BIT) {
+    pOut.setEncoding(PmtaMsgENCODING_8BIT);
+  } else if (pIn.mEncoding == pmta::smtp::ENCODING_BASE64) {
+    pOut.setEncoding(PmtaMsgENCODING_BASE64);
+  }
+  if (pIn.mReturnType == pmta::smtp::RETURN_FULL) {
+    pOut.setReturnType(PmtaMsgRETURN_FULL);
+  } else if (pIn.mReturnType == pmta::smtp::RETURN_HEADERS) {
+    pOut.setReturnType(PmtaMsgRETURN_HEADERS);
+  }
+  if (!pIn.mJobId.empty()) {
+    pOut.setJobId(pIn.mJobId.c_str());
+  }
+  if (!pIn.mEnvelopeId.empty()) {
+    pOut.setEnvelopeId(pIn.mEnvelopeId.c_str());
+  }
+  if (!pIn.mVirtualMta.empty()) {
+    pOut.setVirtualMta(pIn.mVirtualMta.c_str());
+  }
+
+  size_t run = 0;
+  for (size_t p = 0; p < pIn.mParts.size(); p++) {
+    if (p > 0) {
+      pOut.beginPart(p + 1);
+    }
+    const std::string& part = pIn.mParts[p];
+    for (; run < pIn.mRuns.size() && pIn.mRuns[run].mPart == p; run++) {
+      const pmta::smtp::Message::Run& r = pIn.mRuns[run];
+      size_t end = part.size();
+      if (run + 1 < pIn.mRuns.size() && pIn.mRuns[run + 1].mPart == p) {
+        end = pIn.mRuns[run + 1].mOffset;
+      }
+      if (r.mMerge) {
+        pOut.addMergeData(part.data() + r.mOffset, end - r.mOffset);
+      } else {
+        pOut.addData(part.data() + r.mOffset, end - r.mOffset);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < pIn.mRecipients.size(); i++) {
+    const pmta::smtp::Recipient& in = pIn.mRecipients[i];
+    pmta::submitter::Recipient rcpt(in.mAddress.c_str());
+    for (size_t v = 0; v < in.mVariables.size(); v++) {
+      rcpt.defineVariable(in.mVariables[v].first.c_str(),
+        in.mVariables[v].second.c_str());
+    }
+    if (in.mNotifySet) {
+      rcpt.setNotify(in.mNotify);
+    }
+    pOut.addRecipient(rcpt);
+  }
+}
+#endif
+
+/*
+ * PMTAChannel
+ */
+
+PMTAChannel::PMTAChannel (void) {
+#ifndef PMTA_NO_LIBPMTA
+  mConnection     = NULL;
+#endif
+  mSmtpConnection = NULL;
+}
+
+PMTAChannel::~PMTAChannel (void) {
+#ifndef PMTA_NO_LIBPMTA
+  delete mConnection;
+#endif
+  delete mSmtpConnection;
+}
+
+/*
+ * PMTASubmitWorker
+ *
+ * One submitAsync() call. Created when the call is made and queued on the
+ * connection; handed to the thread pool once the limiter admits it.
+ *
+ * Latency is timed from that hand-off, not from when a pool thread picks
+ * the submission up. The limit is kept below the pool size, but the pool
+ * is shared with other work and other connections; when it rather than
+ * PMTA is the bottleneck the wait for a thread then shows up as latency,
+ * and the limit backs off.
+ *
+ * Only failures that say something about load lower the limit: transport
+ * failures, timeouts and 4xx replies. A 5xx reply or a message that cannot
+ * be sent at all, e.g. one whose recipients were all suppressed, does not.
+ */
+class PMTASubmitWorker : public Nan::AsyncWorker {
+
+  public:
+    PMTASubmitWorker (Nan::Callback* pCallback, PMTAConnection* pConnection,
+      PMTAMessage* pMessage)
+      : Nan::AsyncWorker(pCallback), mConnection(pConnection),
+        mMessage(pMessage), mChannel(NULL), mTicket(0), mStarted(0),
+        mOutcome(pmta::concurrency::OUTCOME_OK), mLatency(0) {}
+
+    void start (uint64_t pTicket, PMTAChannel* pChannel) {
+      mTicket  = pTicket;
+      mChannel = pChannel;
+      mStarted = uv_hrtime();
+    }
+
+    void Execute (void) {
+
+      try {
+        if (mMessage->mMessage->mRecipients.empty()) {
+          throw pmta::smtp::Error("submit(): message has no recipients");
+        }
+        if (mConnection->mSmtp) {
+          if (mChannel->mSmtpConnection == NULL) {
+            mChannel->mSmtpConnection = new pmta::smtp::Connection(
+              mConnection->mHost, mConnection->mPort, mConnection->mName,
+              mConnection->mPassword);
+            if (mConnection->mChunkSize > 0) {
+              mChannel->mSmtpConnection->setChunkSize(mConnection->mChunkSize);
+            }
+            if (mConnection->mTimeout > 0) {
+              mChannel->mSmtpConnection->setTimeout(mConnection->mTimeout);
+            }
+          }
+          mRejected = mChannel->mSmtpConnection->submit(*mMessage->mMessage);
+        } else {
+#ifndef PMTA_NO_LIBPMTA
+          if (mChannel->mConnection == NULL) {
+            mChannel->mConnection = new pmta::submitter::Connection(
+              mConnection->mHost, mConnection->mPort, mConnection->mName,
+              mConnection->mPassword);
+          }
+          pmta::submitter::Message message(mMessage->mSender);
+          build(*mMessage->mMessage, message);
+          mChannel->mConnection->submit(message);
+#endif
+        }
+      } catch (pmta::smtp::Error& e) {
+        mError   = e.what();
+        mOutcome = e.temporary() ? pmta::concurrency::OUTCOME_TEMPORARY :
+          pmta::concurrency::OUTCOME_PERMANENT;
+      } catch (std::exception& e) {
+        // libpmta does not say why; count it against the connection.
+        mError   = e.what();
+        mOutcome = pmta::concurrency::OUTCOME_TEMPORARY;
+#ifndef PMTA_NO_LIBPMTA
+        // Reconnect next time rather than guess at the state libpmta left
+        // the connection in.
+        delete mChannel->mConnection;
+        mChannel->mConnection = NULL;
+#endif
+      }
+
+      mLatency = (uv_hrtime() - mStarted) / 1e6;
+    }
+
+    void HandleOKCallback (void) {
+      Nan::HandleScope scope;
+
+      pmta::concurrency::Limiter& limiter = mConnection->mLimiter;
+      std::vector<PMTAChannel*>&  idle    = mConnection->mIdle;
+
+      limiter.release(mTicket, mLatency, mOutcome);
+
+      // Close the connections a lower limit leaves nothing to do for, least
+      // recently used first; dispatch() takes from the back.
+      idle.push_back(mChannel);
+      while (!idle.empty() && idle.size() + limiter.inFlight() >
+        limiter.limit()) {
+        delete idle.front();
+        idle.erase(idle.begin());
+      }
+      mConnection->dispatch();
+
+      v8::Local<v8::Object> ret = submitResult(
+        mOutcome == pmta::concurrency::OUTCOME_OK, mError, mRejected);
+      Nan::Set(ret, Nan::New("latency").ToLocalChecked(),
+        Nan::New<v8::Number>(mLatency));
+
+      v8::Local<v8::Value> argv[] = { ret };
+      callback->Call(1, argv);
+    }
+
+  private:
+    PMTAConnection* mConnection;
+    PMTAMessage*    mMessage;
+    PMTAChannel*    mChannel;
+    uint64_t        mTicket;
+    uint64_t        mStarted;
+
+    pmta::concurrency::Outcome mOutcome;
+    std::string                mError;
+    std::vector<std::string>   mRejected;
+    double                     mLatency;
+};
 
 /*
  * PMTAConnection
@@ -9,10 +241,23 @@ using namespace pmta::submitter;
 Nan::Persistent<v8::Function> PMTAConnection::constructor;
 
 PMTAConnection::PMTAConnection (const char *pHost, int pPort,
-  const char *pName, const char *pPassword)
-  : mHost(pHost), mPort(pPort), mName(pName), mPassword(pPassword) {
-  mConnection = new pmta::submitter::Connection(mHost, mPort, mName,
-    mPassword);
+  const char *pName, const char *pPassword, bool pSmtp)
+  : mHost(pHost), mPort(pPort), mName(pName), mPassword(pPassword),
+    mSmtp(pSmtp), mChunkSize(0), mTimeout(0) {
+#ifndef PMTA_NO_LIBPMTA
+  mConnection     = NULL;
+#endif
+  mSmtpConnection = NULL;
+
+  if (pSmtp) {
+    mSmtpConnection = new pmta::smtp::Connection(mHost, mPort, mName,
+      mPassword);
+  } else {
+#ifndef PMTA_NO_LIBPMTA
+    mConnection = new pmta::submitter::Connection(mHost, mPort, mName,
+      mPassword);
+#endif
+  }
 }
 
 void PMTAConnection::Init (v8::Local<v8::Object> exports) {
@@ -22,7 +267,9 @@ void PMTAConnection::Init (v8::Local<v8::Object> exports) {
   tpl->SetClassName(Nan::New("PMTAConnection").ToLocalChecked());
   tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
-  Nan::SetPrototypeMethod(tpl,  "submit",     submit);
+  Nan::SetPrototypeMethod(tpl,  "submit",       submit);
+  Nan::SetPrototypeMethod(tpl,  "submitAsync",  submitAsync);
+  Nan::SetPrototypeMethod(tpl,  "concurrency",  concurrency);
 
   constructor.Reset(tpl->GetFunction());
   exports->Set(Nan::New("PMTAConnection").ToLocalChecked(),
@@ -30,7 +277,14 @@ void PMTAConnection::Init (v8::Local<v8::Object> exports) {
 }
 
 PMTAConnection::~PMTAConnection() {
+#ifndef PMTA_NO_LIBPMTA
   delete mConnection;
+#endif
+  delete mSmtpConnection;
+
+  for (size_t i = 0; i < mIdle.size(); i++) {
+    delete mIdle[i];
+  }
 }
 
 void PMTAConnection::New (const Nan::FunctionCallbackInfo<v8::Value>& info) {
@@ -73,7 +327,117 @@ void PMTAConnection::New (const Nan::FunctionCallbackInfo<v8::Value>& info) {
     password = strdup(*pPassword);
   }
 
-  PMTAConnection *obj = new PMTAConnection(host, port, name, password);
+#ifndef PMTA_NO_LIBPMTA
+  bool smtp = false;
+#else
+  bool smtp = true;
+#endif
+  int chunkSize = 0;
+  int timeout   = 0;
+  pmta::concurrency::Options limits;
+
+  if (info[4]->IsObject()) {
+    v8::Local<v8::Object> options = info[4]->ToObject();
+    v8::Local<v8::Value> transport =
+      Nan::Get(options, Nan::New("transport").ToLocalChecked())
+        .ToLocalChecked();
+
+    if (!transport->IsUndefined()) {
+      v8::String::Utf8Value pTransport(transport->ToString());
+      if (strcmp(*pTransport, "smtp") == 0) {
+        smtp = true;
+      } else if (strcmp(*pTransport, "api") == 0) {
+#ifndef PMTA_NO_LIBPMTA
+        smtp = false;
+#else
+        return Nan::ThrowError(Nan::Error(
+          "Connection(): built without libpmta, `transport` must be smtp"));
+#endif
+      } else {
+        return Nan::ThrowError(Nan::Error(
+          "Connection(): `transport` must be one of api, smtp"));
+      }
+    }
+
+    v8::Local<v8::Value> chunk =
+      Nan::Get(options, Nan::New("chunkSize").ToLocalChecked())
+        .ToLocalChecked();
+    if (chunk->IsInt32()) {
+      chunkSize = chunk->ToInteger()->Value();
+    }
+
+    v8::Local<v8::Value> seconds =
+      Nan::Get(options, Nan::New("timeout").ToLocalChecked())
+        .ToLocalChecked();
+    if (seconds->IsInt32()) {
+      timeout = seconds->ToInteger()->Value();
+    }
+
+    v8::Local<v8::Value> concurrency =
+      Nan::Get(options, Nan::New("concurrency").ToLocalChecked())
+        .ToLocalChecked();
+    if (concurrency->IsObject()) {
+      struct { const char* name; double* value; } settings[] = {
+        { "initial",    &limits.mInitial },
+        { "min",        &limits.mMin },
+        { "max",        &limits.mMax },
+        { "tolerance",  &limits.mTolerance },
+        { "backoff",    &limits.mBackoff }
+      };
+      for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        v8::Local<v8::Value> value = Nan::Get(concurrency->ToObject(),
+          Nan::New(settings[i].name).ToLocalChecked()).ToLocalChecked();
+        if (value->IsUndefined()) {
+          continue;
+        }
+        if (!value->IsNumber() || !std::isfinite(value->NumberValue())) {
+          return Nan::ThrowError(Nan::TypeError((std::string(
+            "Connection(): `concurrency.") + settings[i].name +
+            "` must be a finite number").c_str()));
+        }
+        *settings[i].value = value->NumberValue();
+      }
+
+      if (!(limits.mBackoff > 0 && limits.mBackoff < 1)) {
+        return Nan::ThrowError(Nan::Error(
+          "Connection(): `concurrency.backoff` must be between 0 and 1"));
+      }
+      if (limits.mTolerance < 1) {
+        return Nan::ThrowError(Nan::Error(
+          "Connection(): `concurrency.tolerance` must be at least 1"));
+      }
+    }
+  }
+
+  // Each submission in flight holds a thread pool thread until PMTA has
+  // answered, so more than the pool could run would only queue for threads,
+  // and a full pool would also hold up the file system, DNS and crypto work
+  // that shares it. Keep at least one thread for that.
+  const char* threads = getenv("UV_THREADPOOL_SIZE");
+  int pool = threads != NULL ? atoi(threads) : 4;
+  if (pool < 1) {
+    pool = 1;
+  }
+  double cap = pool > 1 ? pool - 1 : 1;
+  if (limits.mMax > cap) {
+    limits.mMax = cap;
+  }
+  if (limits.mMin > limits.mMax) {
+    limits.mMin = limits.mMax;
+  }
+
+  PMTAConnection *obj = new PMTAConnection(host, port, name, password, smtp);
+  obj->mChunkSize = chunkSize;
+  obj->mTimeout   = timeout;
+  obj->mLimiter   = pmta::concurrency::Limiter(limits);
+  if (obj->mSmtpConnection != NULL) {
+    if (chunkSize > 0) {
+      obj->mSmtpConnection->setChunkSize(chunkSize);
+    }
+    if (timeout > 0) {
+      obj->mSmtpConnection->setTimeout(timeout);
+    }
+  }
   obj->Wrap(info.This());
   info.GetReturnValue().Set(info.This());
 }
@@ -81,7 +445,13 @@ void PMTAConnection::New (const Nan::FunctionCallbackInfo<v8::Value>& info) {
 void PMTAConnection::submit (const Nan::FunctionCallbackInfo<v8::Value>& info) {
 
   if (info.Length() < 1) {
-    Nan::ThrowError(Nan::Error("submitSync(message): missing argument"));
+    return Nan::ThrowError(
+      Nan::Error("submitSync(message): missing argument"));
+  }
+
+  if (!PMTAMessage::IsInstance(info[0])) {
+    return Nan::ThrowError(Nan::TypeError(
+      "submit(): `message` must be a Message"));
   }
 
   PMTAConnection* connection = 
@@ -89,25 +459,112 @@ void PMTAConnection::submit (const Nan::FunctionCallbackInfo<v8::Value>& info) {
   PMTAMessage*    message    = 
     ObjectWrap::Unwrap<PMTAMessage>(info[0]->ToObject());
 
-  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  std::vector<std::string> rejected;
   try {
-    connection->mConnection->submit(*message->mMessage);
-    Nan::Set(ret, Nan::New("submitted").ToLocalChecked(), Nan::New(true));
+    if (connection->mSmtpConnection != NULL) {
+      rejected = connection->mSmtpConnection->submit(*message->mMessage);
+    } else {
+#ifndef PMTA_NO_LIBPMTA
+      pmta::submitter::Message built(message->mSender);
+      build(*message->mMessage, built);
+      connection->mConnection->submit(built);
+#endif
+    }
   } catch (std::exception& e) {
-    Nan::Set(ret, Nan::New("submitted").ToLocalChecked(), Nan::New(false));
-    Nan::Set(ret, Nan::New("errorMessage").ToLocalChecked(), 
-      Nan::New(e.what()).ToLocalChecked());
+    info.GetReturnValue().Set(submitResult(false, e.what(), rejected));
+    return;
+  }
+  info.GetReturnValue().Set(submitResult(true, "", rejected));
+}
+
+void PMTAConnection::submitAsync (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (info.Length() < 2 || !info[1]->IsFunction()) {
+    return Nan::ThrowError(
+      Nan::Error("submitAsync(message, callback): missing argument"));
+  }
+
+  if (!PMTAMessage::IsInstance(info[0])) {
+    return Nan::ThrowError(Nan::TypeError(
+      "submitAsync(): `message` must be a Message"));
   }
+
+  PMTAConnection* connection =
+    ObjectWrap::Unwrap<PMTAConnection>(info.Holder());
+  PMTAMessage*    message    =
+    ObjectWrap::Unwrap<PMTAMessage>(info[0]->ToObject());
+
+  PMTASubmitWorker* worker = new PMTASubmitWorker(
+    new Nan::Callback(info[1].As<v8::Function>()), connection, message);
+  worker->SaveToPersistent("connection", info.Holder());
+  worker->SaveToPersistent("message", info[0]->ToObject());
+
+  connection->mQueue.push_back(worker);
+  connection->dispatch();
+  info.GetReturnValue().Set(Nan::Undefined());
+}
+
+void PMTAConnection::concurrency (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  PMTAConnection* connection =
+    ObjectWrap::Unwrap<PMTAConnection>(info.Holder());
+  const pmta::concurrency::Limiter& limiter = connection->mLimiter;
+
+  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  Nan::Set(ret, Nan::New("limit").ToLocalChecked(),
+    Nan::New(limiter.limit()));
+  Nan::Set(ret, Nan::New("inFlight").ToLocalChecked(),
+    Nan::New(limiter.inFlight()));
+  Nan::Set(ret, Nan::New("queued").ToLocalChecked(),
+    Nan::New<v8::Number>(connection->mQueue.size()));
+  Nan::Set(ret, Nan::New("latency").ToLocalChecked(),
+    Nan::New<v8::Number>(limiter.latency()));
+  Nan::Set(ret, Nan::New("baseline").ToLocalChecked(),
+    Nan::New<v8::Number>(limiter.baseline()));
   info.GetReturnValue().Set(ret);
 }
 
+/*
+ * Starts queued submissions while the limiter has room for them.
+ */
+void PMTAConnection::dispatch (void) {
+  while (!mQueue.empty()) {
+    uint64_t ticket = mLimiter.acquire();
+    if (ticket == 0) {
+      break;
+    }
+
+    PMTAChannel* channel;
+    if (mIdle.empty()) {
+      channel = new PMTAChannel();
+    } else {
+      channel = mIdle.back();
+      mIdle.pop_back();
+    }
+
+    PMTASubmitWorker* worker = mQueue.front();
+    mQueue.pop_front();
+    worker->start(ticket, channel);
+    Nan::AsyncQueueWorker(worker);
+  }
+}
+
 /* 
  * PMTAMessage
  */
 Nan::Persistent<v8::Function> PMTAMessage::constructor;
-
-PMTAMessage::PMTAMessage (const char* psender) : mSender(psender) {
-  mMessage = new pmta::submitter::Message(mSender);
+Nan::Persistent<v8::FunctionTemplate> PMTAMessage::tmpl;
+
+PMTAMessage::PMTAMessage (const char* psender)
+  : mSender(psender), mSuppressed(0) {
+#ifndef PMTA_NO_LIBPMTA
+  // Only to have libpmta check the sender now, as it did when it kept a
+  // message of its own; the one it submits is built at submit time.
+  pmta::submitter::Message check(mSender);
+#endif
+  mMessage = new pmta::smtp::Message(mSender);
 }
 
 PMTAMessage::~PMTAMessage (void) {
@@ -128,17 +585,24 @@ void PMTAMessage::Init (v8::Local<v8::Object> exports) {
   Nan::SetPrototypeMethod(tpl, "beginPart",     beginPart);
   Nan::SetPrototypeMethod(tpl, "setEncoding",   setEncoding);
   Nan::SetPrototypeMethod(tpl, "addRecipient",  addRecipient);
+  Nan::SetPrototypeMethod(tpl, "addRecipients", addRecipients);
+  Nan::SetPrototypeMethod(tpl, "suppressedCount", suppressedCount);
   Nan::SetPrototypeMethod(tpl, "addMergeData",  addMergeData);
   Nan::SetPrototypeMethod(tpl, "setReturnType", setReturnType);
   Nan::SetPrototypeMethod(tpl, "setEnvelopeId", setEnvelopeId);
   Nan::SetPrototypeMethod(tpl, "setVirtualMta", setVirtualMta);
   Nan::SetPrototypeMethod(tpl, "addDateHeader", addDateHeader);
 
+  tmpl.Reset(tpl);
   constructor.Reset(tpl->GetFunction());
   exports->Set(Nan::New("PMTAMessage").ToLocalChecked(),
     tpl->GetFunction());
 }
 
+bool PMTAMessage::IsInstance (v8::Local<v8::Value> pValue) {
+  return Nan::New(tmpl)->HasInstance(pValue);
+}
+
 void PMTAMessage::New (const Nan::FunctionCallbackInfo<v8::Value>& info) {
   if (!info.IsConstructCall()) {
     Nan::ThrowError(Nan::TypeError(
@@ -177,7 +641,7 @@ void PMTAMessage::setVerp (const Nan::FunctionCallbackInfo<v8::Value>& info) {
   PMTAMessage* obj = ObjectWrap::Unwrap<PMTAMessage>(info.Holder());
   v8::Local<v8::Boolean> param0(info[0]->ToBoolean());
   bool verp = param0->BooleanValue();
-  obj->mMessage->setVerp(verp);
+  obj->mMessage->mVerp = verp;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -192,19 +656,19 @@ void PMTAMessage::setEncoding
   v8::String::Utf8Value psetEncoding(info[0]->ToString());
   const char *set_encoding(*psetEncoding);
 
-  PmtaMsgENCODING encoding;
+  pmta::smtp::Encoding encoding;
 
   if (strcmp(set_encoding, "ENCODING_7BIT") == 0) {
-    encoding = PmtaMsgENCODING_7BIT;
+    encoding = pmta::smtp::ENCODING_7BIT;
   } else if (strcmp(set_encoding, "ENCODING_8BIT") == 0) {
-    encoding = PmtaMsgENCODING_8BIT;
+    encoding = pmta::smtp::ENCODING_8BIT;
   } else if (strcmp(set_encoding, "ENCODING_BASE64") == 0) {
-    encoding = PmtaMsgENCODING_BASE64;
+    encoding = pmta::smtp::ENCODING_BASE64;
   } else {
-    encoding = PmtaMsgENCODING_7BIT;
+    encoding = pmta::smtp::ENCODING_7BIT;
   }
 
-  obj->mMessage->setEncoding(encoding);
+  obj->mMessage->mEncoding = encoding;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -218,7 +682,7 @@ void PMTAMessage::setJobId (const Nan::FunctionCallbackInfo<v8::Value>& info) {
   v8::String::Utf8Value param1(info[0]->ToString());
   const char* jobid = strdup(*param1);
 
-  obj->mMessage->setJobId(jobid);
+  obj->mMessage->mJobId = jobid;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -233,17 +697,10 @@ void PMTAMessage::setReturnType (
   v8::String::Utf8Value param1(info[0]->ToString());
   char* cmp = strdup(*param1);
 
-  PmtaMsgRETURN ret;
-
-  if (strcmp(cmp,"RETURN_FULL") == 0) {
-    ret = PmtaMsgRETURN_FULL;
-  } else if (strcmp(cmp,"RETURN_HEADERS") == 0) {
-    ret = PmtaMsgRETURN_HEADERS;
-  } else {
-    ret = PmtaMsgRETURN_HEADERS;
-  }
+  bool full = strcmp(cmp,"RETURN_FULL") == 0;
 
-  obj->mMessage->setReturnType(ret);
+  obj->mMessage->mReturnType =
+    full ? pmta::smtp::RETURN_FULL : pmta::smtp::RETURN_HEADERS;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -258,7 +715,7 @@ void PMTAMessage::setEnvelopeId (
   v8::String::Utf8Value param1(info[0]->ToString());
   const char* eid = strdup(*param1);
 
-  obj->mMessage->setEnvelopeId(eid);
+  obj->mMessage->mEnvelopeId = eid;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -273,7 +730,7 @@ void PMTAMessage::setVirtualMta (
   v8::String::Utf8Value param1(info[0]->ToString());
   const char* vmta = strdup(*param1);
 
-  obj->mMessage->setVirtualMta(vmta);
+  obj->mMessage->mVirtualMta = vmta;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -290,7 +747,11 @@ void PMTAMessage::beginPart(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   Nan::ThrowError(
     Nan::Error("beginPart(Int part): `part` must be greater than 1"));
   }
-  obj->mMessage->beginPart(part);
+  try {
+    obj->mMessage->beginPart(part);
+  } catch (std::exception& e) {
+    return Nan::ThrowError(Nan::Error(e.what()));
+  }
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -316,7 +777,7 @@ void PMTAMessage::addData (const Nan::FunctionCallbackInfo<v8::Value>& info) {
   const char* data = strdup(*param1);
   int length = info[1]->ToInteger()->Value();
 
-  obj->mMessage->addData(data, length);
+  obj->mMessage->addData(data, length, false);
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -343,7 +804,7 @@ void PMTAMessage::addMergeData (
   const char* data = strdup(*param1);
   int length = info[1]->ToInteger()->Value();
 
-  obj->mMessage->addMergeData(data, length);
+  obj->mMessage->addData(data, length, true);
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -360,24 +821,105 @@ void PMTAMessage::addRecipient (
   const Nan::FunctionCallbackInfo<v8::Value>& info) {
 
   if (info.Length() < 1) {
-  Nan::ThrowError(Nan::Error("addRecipient(Recipient recipient)"));
+    return Nan::ThrowError(Nan::Error("addRecipient(Recipient recipient)"));
+  }
+
+  if (!PMTARecipient::IsInstance(info[0])) {
+    return Nan::ThrowError(Nan::TypeError(
+      "addRecipient(): `recipient` must be a Recipient"));
+  }
+
+  const pmta::suppression::Index* suppression = NULL;
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!PMTASuppressionIndex::IsInstance(info[1])) {
+      return Nan::ThrowError(Nan::TypeError(
+        "addRecipient(): `suppression` must be a SuppressionIndex"));
+    }
+    suppression = ObjectWrap::Unwrap<PMTASuppressionIndex>(
+      info[1]->ToObject())->mIndex;
   }
 
   PMTAMessage* obj = ObjectWrap::Unwrap<PMTAMessage>(info.Holder());
   PMTARecipient* robj = ObjectWrap::Unwrap<PMTARecipient>(info[0]->ToObject());
 
-  obj->mMessage->addRecipient(*robj->mRecipient);
+  info.GetReturnValue().Set(Nan::New(obj->add(robj, suppression)));
+}
 
-  info.GetReturnValue().Set(Nan::Undefined());
+void PMTAMessage::addRecipients (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (info.Length() < 1 || !info[0]->IsArray()) {
+    return Nan::ThrowError(
+      Nan::Error("addRecipients(Array recipients, [SuppressionIndex])"));
+  }
+
+  const pmta::suppression::Index* suppression = NULL;
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!PMTASuppressionIndex::IsInstance(info[1])) {
+      return Nan::ThrowError(Nan::TypeError(
+        "addRecipients(): `suppression` must be a SuppressionIndex"));
+    }
+    suppression = ObjectWrap::Unwrap<PMTASuppressionIndex>(
+      info[1]->ToObject())->mIndex;
+  }
+
+  PMTAMessage* obj = ObjectWrap::Unwrap<PMTAMessage>(info.Holder());
+  v8::Local<v8::Array> list = info[0].As<v8::Array>();
+
+  // Check every element first so a bad one leaves the message unchanged.
+  std::vector<PMTARecipient*> recipients;
+  recipients.reserve(list->Length());
+  for (uint32_t i = 0; i < list->Length(); i++) {
+    v8::Local<v8::Value> rcpt = Nan::Get(list, i).ToLocalChecked();
+    if (!PMTARecipient::IsInstance(rcpt)) {
+      return Nan::ThrowError(Nan::TypeError(
+        "addRecipients(): `recipients` must only contain Recipients"));
+    }
+    recipients.push_back(ObjectWrap::Unwrap<PMTARecipient>(rcpt->ToObject()));
+  }
+
+  uint32_t added = 0;
+  for (size_t i = 0; i < recipients.size(); i++) {
+    if (obj->add(recipients[i], suppression)) {
+      added++;
+    }
+  }
+
+  info.GetReturnValue().Set(Nan::New(added));
+}
+
+void PMTAMessage::suppressedCount (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  PMTAMessage* obj = ObjectWrap::Unwrap<PMTAMessage>(info.Holder());
+  info.GetReturnValue().Set(Nan::New(obj->mSuppressed));
+}
+
+bool PMTAMessage::add (PMTARecipient* pRecipient,
+  const pmta::suppression::Index* pSuppression) {
+
+  if (pSuppression != NULL &&
+    pSuppression->has(pRecipient->mAddress, strlen(pRecipient->mAddress))) {
+    mSuppressed++;
+    return false;
+  }
+
+  mMessage->mRecipients.push_back(*pRecipient->mRecipient);
+  return true;
 }
 
 /*
  * PMTARecipient
  */
 Nan::Persistent<v8::Function> PMTARecipient::constructor;
+Nan::Persistent<v8::FunctionTemplate> PMTARecipient::tmpl;
 
 PMTARecipient::PMTARecipient (const char* pAddress) : mAddress(pAddress) {
-  mRecipient = new Recipient(mAddress);
+#ifndef PMTA_NO_LIBPMTA
+  // As for PMTAMessage, only so libpmta checks the address now.
+  pmta::submitter::Recipient check(mAddress);
+#endif
+  mRecipient = new pmta::smtp::Recipient(mAddress);
 }
 
 PMTARecipient::~PMTARecipient (void) {
@@ -395,11 +937,16 @@ void PMTARecipient::Init (v8::Local<v8::Object> exports) {
   Nan::SetPrototypeMethod(tpl,  "defineVariable",   defineVariable);
   Nan::SetPrototypeMethod(tpl,  "setNotify",        setNotify);
 
+  tmpl.Reset(tpl);
   constructor.Reset(tpl->GetFunction());
   exports->Set(Nan::New("PMTARecipient").ToLocalChecked(),
     tpl->GetFunction());
 }
 
+bool PMTARecipient::IsInstance (v8::Local<v8::Value> pValue) {
+  return Nan::New(tmpl)->HasInstance(pValue);
+}
+
 void PMTARecipient::New (const Nan::FunctionCallbackInfo<v8::Value>& info) {
 
   if (!info.IsConstructCall()) {
@@ -442,10 +989,20 @@ void PMTARecipient::setNotify (
     Nan::ThrowError(Nan::TypeError("Argument must be a number"));
   }
 
+  // NEVER, or any combination of SUCCESS, FAILURE and DELAY.
+  double notify = info[0]->NumberValue();
+  if (!(notify >= 0 && notify <= pmta::smtp::NOTIFY_MASK) ||
+    notify != (int)notify) {
+    return Nan::ThrowError(Nan::TypeError(
+      "setNotify(): `notify` must be PmtaRcptNOTIFY_NEVER or a combination "
+      "of PmtaRcptNOTIFY_SUCCESS, _FAILURE and _DELAY"));
+  }
+
   PMTARecipient* obj  = ObjectWrap::Unwrap<PMTARecipient>(info.Holder());
-  int notify_when     = info[0]->ToInteger()->Value();
+  int notify_when     = (int)notify;
 
-  obj->mRecipient->setNotify(notify_when);
+  obj->mRecipient->mNotify    = notify_when;
+  obj->mRecipient->mNotifySet = true;
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -471,14 +1028,336 @@ void PMTARecipient::defineVariable (
   char* name  = strdup(*pName);
   char* value = strdup(*pValue);
 
-  obj->mRecipient->defineVariable(name, value);
+  obj->mRecipient->mVariables.push_back(
+    std::make_pair(std::string(name), std::string(value)));
   info.GetReturnValue().Set(Nan::Undefined());
 }
 
+/*
+ * PMTAAccountingReader
+ */
+Nan::Persistent<v8::Function> PMTAAccountingReader::constructor;
+
+PMTAAccountingReader::PMTAAccountingReader (const std::string& pPath,
+  const std::vector<pmta::accounting::Column>& pColumns,
+  const std::vector<std::string>& pTypes, bool pFollow, size_t pBatchSize)
+  : mBatchSize(pBatchSize) {
+  mReader = new pmta::accounting::Reader(pPath, pColumns, pTypes, pFollow);
+}
+
+PMTAAccountingReader::~PMTAAccountingReader (void) {
+  delete mReader;
+}
+
+void PMTAAccountingReader::Init (v8::Local<v8::Object> exports) {
+  Nan::HandleScope scope;
+
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+  tpl->SetClassName(Nan::New("PMTAAccountingReader").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  Nan::SetPrototypeMethod(tpl,  "read",   read);
+  Nan::SetPrototypeMethod(tpl,  "close",  close);
+
+  constructor.Reset(tpl->GetFunction());
+  exports->Set(Nan::New("PMTAAccountingReader").ToLocalChecked(),
+    tpl->GetFunction());
+}
+
+void PMTAAccountingReader::New (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowError(Nan::TypeError(
+      "Use the `new` operator to create PMTAAccountingReader"));
+  }
+
+  if (!info[0]->IsString() || !info[1]->IsObject()) {
+    return Nan::ThrowError(Nan::TypeError(
+      "AccountingReader(String path, Object options)"));
+  }
+
+  v8::String::Utf8Value pPath(info[0]->ToString());
+  v8::Local<v8::Object> options = info[1]->ToObject();
+
+  v8::Local<v8::Value> columns =
+    Nan::Get(options, Nan::New("columns").ToLocalChecked()).ToLocalChecked();
+  if (!columns->IsArray()) {
+    return Nan::ThrowError(Nan::TypeError(
+      "AccountingReader(): `columns` must be an array"));
+  }
+
+  std::vector<pmta::accounting::Column> cols;
+  v8::Local<v8::Array> list = columns.As<v8::Array>();
+  for (uint32_t i = 0; i < list->Length(); i++) {
+    v8::Local<v8::Value> column = Nan::Get(list, i).ToLocalChecked();
+    v8::Local<v8::Value> name   = column;
+    v8::Local<v8::Value> type   = Nan::Undefined();
+
+    if (column->IsObject()) {
+      name = Nan::Get(column->ToObject(), Nan::New("name").ToLocalChecked())
+        .ToLocalChecked();
+      type = Nan::Get(column->ToObject(), Nan::New("type").ToLocalChecked())
+        .ToLocalChecked();
+    }
+    if (!name->IsString()) {
+      return Nan::ThrowError(Nan::TypeError(
+        "AccountingReader(): column `name` must be a string"));
+    }
+
+    v8::String::Utf8Value pName(name->ToString());
+    pmta::accounting::ColumnType columnType = pmta::accounting::COLUMN_STRING;
+    if (!type->IsUndefined()) {
+      v8::String::Utf8Value pType(type->ToString());
+      if (strcmp(*pType, "number") == 0) {
+        columnType = pmta::accounting::COLUMN_NUMBER;
+      } else if (strcmp(*pType, "time") == 0) {
+        columnType = pmta::accounting::COLUMN_TIME;
+      } else if (strcmp(*pType, "string") != 0) {
+        return Nan::ThrowError(Nan::TypeError(
+          "AccountingReader(): column `type` must be string, number or time"));
+      }
+    }
+    cols.push_back(pmta::accounting::Column(*pName, columnType));
+  }
+
+  std::vector<std::string> types;
+  v8::Local<v8::Value> pTypes =
+    Nan::Get(options, Nan::New("types").ToLocalChecked()).ToLocalChecked();
+  if (pTypes->IsArray()) {
+    v8::Local<v8::Array> typeList = pTypes.As<v8::Array>();
+    for (uint32_t i = 0; i < typeList->Length(); i++) {
+      v8::String::Utf8Value pType(
+        Nan::Get(typeList, i).ToLocalChecked()->ToString());
+      types.push_back(*pType);
+    }
+  }
+
+  bool follow = Nan::Get(options, Nan::New("follow").ToLocalChecked())
+    .ToLocalChecked()->BooleanValue();
+
+  size_t batchSize = 10000;
+  v8::Local<v8::Value> pBatchSize =
+    Nan::Get(options, Nan::New("batchSize").ToLocalChecked())
+      .ToLocalChecked();
+  if (pBatchSize->IsInt32() && pBatchSize->ToInteger()->Value() > 0) {
+    batchSize = pBatchSize->ToInteger()->Value();
+  }
+
+  PMTAAccountingReader* obj =
+    new PMTAAccountingReader(*pPath, cols, types, follow, batchSize);
+  obj->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+void PMTAAccountingReader::read (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  PMTAAccountingReader* obj =
+    ObjectWrap::Unwrap<PMTAAccountingReader>(info.Holder());
+
+  size_t maxRows = obj->mBatchSize;
+  if (info[0]->IsInt32() && info[0]->ToInteger()->Value() > 0) {
+    maxRows = info[0]->ToInteger()->Value();
+  }
+
+  pmta::accounting::Batch& batch = obj->mBatch;
+  try {
+    if (!obj->mReader->read(batch, maxRows)) {
+      info.GetReturnValue().Set(Nan::Null());
+      return;
+    }
+  } catch (std::exception& e) {
+    return Nan::ThrowError(Nan::Error(e.what()));
+  }
+
+  const std::vector<pmta::accounting::Column>& cols =
+    obj->mReader->columns();
+  v8::Local<v8::Object> columns = Nan::New<v8::Object>();
+
+  for (size_t c = 0; c < cols.size(); c++) {
+    v8::Local<v8::Value> column;
+
+    if (cols[c].mType == pmta::accounting::COLUMN_STRING) {
+      const std::vector<pmta::accounting::Span>& spans = batch.mStrings[c];
+      v8::Local<v8::Array> values = Nan::New<v8::Array>(batch.mRows);
+
+      // Job ids, types, statuses and vmtas repeat from row to row; reuse
+      // the previous string rather than creating an identical one.
+      v8::Local<v8::String> previous = Nan::EmptyString();
+      const char* previousData   = "";
+      size_t      previousLength = 0;
+
+      for (size_t r = 0; r < batch.mRows; r++) {
+        const pmta::accounting::Span& span = spans[r];
+        if (span.mLength != previousLength ||
+          memcmp(span.mData, previousData, span.mLength) != 0) {
+          previous = Nan::New<v8::String>(span.mData, span.mLength)
+            .ToLocalChecked();
+          previousData   = span.mData;
+          previousLength = span.mLength;
+        }
+        Nan::Set(values, r, previous);
+      }
+      column = values;
+    } else {
+      const std::vector<double>& numbers = batch.mNumbers[c];
+      v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(
+        v8::Isolate::GetCurrent(), batch.mRows * sizeof(double));
+      v8::Local<v8::Float64Array> values =
+        v8::Float64Array::New(buffer, 0, batch.mRows);
+
+      Nan::TypedArrayContents<double> contents(values);
+      if (batch.mRows > 0) {
+        memcpy(*contents, &numbers[0], batch.mRows * sizeof(double));
+      }
+      column = values;
+    }
+
+    Nan::Set(columns, Nan::New(cols[c].mName).ToLocalChecked(), column);
+  }
+
+  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  Nan::Set(ret, Nan::New("length").ToLocalChecked(),
+    Nan::New<v8::Number>(batch.mRows));
+  Nan::Set(ret, Nan::New("offset").ToLocalChecked(),
+    Nan::New<v8::Number>(obj->mReader->offset()));
+  Nan::Set(ret, Nan::New("columns").ToLocalChecked(), columns);
+  info.GetReturnValue().Set(ret);
+}
+
+void PMTAAccountingReader::close (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  PMTAAccountingReader* obj =
+    ObjectWrap::Unwrap<PMTAAccountingReader>(info.Holder());
+  obj->mReader->close();
+  obj->mBatch.clear();
+  info.GetReturnValue().Set(Nan::Undefined());
+}
+
+/*
+ * PMTASuppressionIndex
+ */
+Nan::Persistent<v8::Function> PMTASuppressionIndex::constructor;
+Nan::Persistent<v8::FunctionTemplate> PMTASuppressionIndex::tmpl;
+
+PMTASuppressionIndex::PMTASuppressionIndex (const char* pPath) {
+  mIndex = new pmta::suppression::Index(pPath);
+}
+
+PMTASuppressionIndex::~PMTASuppressionIndex (void) {
+  delete mIndex;
+}
+
+void PMTASuppressionIndex::Init (v8::Local<v8::Object> exports) {
+  Nan::HandleScope scope;
+
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+  tpl->SetClassName(Nan::New("PMTASuppressionIndex").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  Nan::SetPrototypeMethod(tpl,  "has",    has);
+  Nan::SetPrototypeMethod(tpl,  "size",   size);
+  Nan::SetMethod(tpl,           "build",  build);
+
+  tmpl.Reset(tpl);
+  constructor.Reset(tpl->GetFunction());
+  exports->Set(Nan::New("PMTASuppressionIndex").ToLocalChecked(),
+    tpl->GetFunction());
+}
+
+bool PMTASuppressionIndex::IsInstance (v8::Local<v8::Value> pValue) {
+  return Nan::New(tmpl)->HasInstance(pValue);
+}
+
+void PMTASuppressionIndex::New (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowError(Nan::TypeError(
+      "Use the `new` operator to create PMTASuppressionIndex"));
+  }
+
+  if (!info[0]->IsString()) {
+    return Nan::ThrowError(Nan::TypeError(
+      "SuppressionIndex(String path): `path` must be a string"));
+  }
+
+  v8::String::Utf8Value pPath(info[0]->ToString());
+
+  try {
+    PMTASuppressionIndex* obj = new PMTASuppressionIndex(*pPath);
+    obj->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  } catch (std::exception& e) {
+    Nan::ThrowError(Nan::Error(e.what()));
+  }
+}
+
+void PMTASuppressionIndex::has (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (!info[0]->IsString()) {
+    return Nan::ThrowError(Nan::TypeError("has(String address)"));
+  }
+
+  PMTASuppressionIndex* obj =
+    ObjectWrap::Unwrap<PMTASuppressionIndex>(info.Holder());
+  v8::String::Utf8Value pAddress(info[0]->ToString());
+
+  info.GetReturnValue().Set(
+    Nan::New(obj->mIndex->has(*pAddress, pAddress.length())));
+}
+
+void PMTASuppressionIndex::size (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  PMTASuppressionIndex* obj =
+    ObjectWrap::Unwrap<PMTASuppressionIndex>(info.Holder());
+  info.GetReturnValue().Set(
+    Nan::New<v8::Number>(static_cast<double>(obj->mIndex->size())));
+}
+
+void PMTASuppressionIndex::build (
+  const Nan::FunctionCallbackInfo<v8::Value>& info) {
+
+  if (info.Length() < 2 || !info[1]->IsString() ||
+    !(info[0]->IsArray() || info[0]->IsString())) {
+    return Nan::ThrowError(Nan::TypeError(
+      "build(Array addresses | String file, String path)"));
+  }
+
+  v8::String::Utf8Value pPath(info[1]->ToString());
+  pmta::suppression::Builder builder;
+
+  try {
+    if (info[0]->IsString()) {
+      v8::String::Utf8Value pFile(info[0]->ToString());
+      builder.addFile(*pFile);
+    } else {
+      v8::Local<v8::Array> list = info[0].As<v8::Array>();
+      for (uint32_t i = 0; i < list->Length(); i++) {
+        v8::String::Utf8Value pAddress(
+          Nan::Get(list, i).ToLocalChecked()->ToString());
+        builder.add(*pAddress, pAddress.length());
+      }
+    }
+
+    uint64_t count = builder.write(*pPath);
+    info.GetReturnValue().Set(
+      Nan::New<v8::Number>(static_cast<double>(count)));
+  } catch (std::exception& e) {
+    Nan::ThrowError(Nan::Error(e.what()));
+  }
+}
+
 void RegisterModule (v8::Local<v8::Object> exports) {
   PMTAMessage::Init(exports);
   PMTARecipient::Init(exports);
   PMTAConnection::Init(exports);
+  PMTAAccountingReader::Init(exports);
+  PMTASuppressionIndex::Init(exports);
 }
 
 NODE_MODULE(pmta, RegisterModule);
@@ -38,21 +38,59 @@
 
 #include <nan.h>
 #include <node.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#ifndef PMTA_NO_LIBPMTA
 #include "submitter/Message.hxx"
 #include "submitter/Recipient.hxx"
 #include "submitter/Connection.hxx"
+#endif
+
+#include "smtp.h"
+#include "accounting.h"
+#include "suppression.h"
+#include "limiter.h"
+
+class PMTARecipient;
+class PMTASubmitWorker;
+
+/*!
+ * \brief An underlying connection used by one asynchronous submission at a
+ *        time. Only the member for the connection's transport is used; it
+ *        is opened by the first submission that needs it.
+ */
+struct PMTAChannel {
+  PMTAChannel (void);
+  ~PMTAChannel (void);
+
+#ifndef PMTA_NO_LIBPMTA
+  pmta::submitter::Connection* mConnection;
+#endif
+  pmta::smtp::Connection* mSmtpConnection;
+};
 
 /*!
  * \addtogroup connection PMTA Connection
  * \brief Represents a connection to a PMTA host.
+ *
+ * Messages are submitted either through the PMTA submission API (libpmta)
+ * or, with the "smtp" transport, by speaking ESMTP directly to the PMTA
+ * SMTP listener. Exactly one of mConnection and mSmtpConnection is set.
+ * Builds configured without libpmta only offer the "smtp" transport.
  */
 class PMTAConnection : public Nan::ObjectWrap {
 
   public:
     static void Init (v8::Local<v8::Object> exports);
+#ifndef PMTA_NO_LIBPMTA
     pmta::submitter::Connection* mConnection;
+#endif
+    pmta::smtp::Connection* mSmtpConnection;
 
     ~PMTAConnection (void);
 
@@ -63,12 +101,13 @@ class PMTAConnection : public Nan::ObjectWrap {
      * \param pPort Connection port
      * \param pName User name (optional)
      * \param pPassword Password (optional);
+     * \param pSmtp Use the native SMTP transport instead of libpmta
      *
      * Objects derived from this class represent a connection to a PMTA
      * instance on a remote host or the local host. 
      */
     PMTAConnection (const char* pHost, int pPort, const char* pName = "",
-      const char* pPassword = "");
+      const char* pPassword = "", bool pSmtp = false);
 
     static void New (const Nan::FunctionCallbackInfo<v8::Value>& info);
 
@@ -77,13 +116,47 @@ class PMTAConnection : public Nan::ObjectWrap {
      * \param pMessage A Message object
      *
      * This method submits the supplied Message object to a PMTA host.
+     * With the "smtp" transport the result also carries
+     * `rejectedRecipients` when the host refused some, but not all, of
+     * the message recipients.
      */
     static void submit (const Nan::FunctionCallbackInfo<v8::Value>& info);
 
+    /*!
+     * \brief Submits a message without blocking
+     * \param pMessage A Message object
+     * \param pCallback Called with the same result object submit returns,
+     *        plus `latency`, the time the submission took in milliseconds
+     *
+     * Submissions run on the libuv thread pool, each on its own underlying
+     * connection, with at most `limit` of them in flight; the rest wait in
+     * order. The limit adapts to the latency measured for each submission
+     * (see pmta::concurrency::Limiter) and stays below UV_THREADPOOL_SIZE;
+     * connections it no longer needs are closed. The message must not be
+     * changed until the callback has been called.
+     */
+    static void submitAsync (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Returns the state of the concurrency limiter
+     * \return An object { limit, inFlight, queued, latency, baseline } with
+     *         latencies in milliseconds.
+     */
+    static void concurrency (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    void dispatch (void);
+
     const char *mHost;
     int         mPort;
     const char *mName;
     const char *mPassword;
+    bool        mSmtp;
+    int         mChunkSize;
+    int         mTimeout;
+
+    pmta::concurrency::Limiter     mLimiter;
+    std::deque<PMTASubmitWorker*>  mQueue;
+    std::vector<PMTAChannel*>      mIdle;
 
   private:
     static Nan::Persistent<v8::Function> constructor;
@@ -100,7 +173,13 @@ class PMTAMessage : public Nan::ObjectWrap {
 
   public:
     static void Init (v8::Local<v8::Object> exports);
-    pmta::submitter::Message* mMessage;
+    static bool IsInstance (v8::Local<v8::Value> pValue);
+    /*!
+     * Everything set on the message. Sent as it is by the "smtp"
+     * transport; the "api" transport builds a libpmta message from it for
+     * each submission.
+     */
+    pmta::smtp::Message* mMessage;
 
     ~PMTAMessage(void);
 
@@ -161,9 +240,29 @@ class PMTAMessage : public Nan::ObjectWrap {
     /*!
      * \brief Adds a Recipient to the message.
      * \param pRecipient PMTA Recipient
+     * \param pSuppression SuppressionIndex (optional). If the recipient
+     *        address is in it, the recipient is not added and is counted
+     *        in suppressedCount instead.
+     * \return True if the recipient was added.
      */
     static void addRecipient (const Nan::FunctionCallbackInfo<v8::Value>& info);
 
+    /*!
+     * \brief Adds an array of Recipients to the message.
+     * \param pRecipients Array of PMTA Recipients
+     * \param pSuppression SuppressionIndex (optional), as for addRecipient.
+     * \return Number of recipients added.
+     */
+    static void addRecipients (
+      const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Number of recipients addRecipient and addRecipients dropped
+     *        because they were in the suppression index.
+     */
+    static void suppressedCount (
+      const Nan::FunctionCallbackInfo<v8::Value>& info);
+
     /*!
      * \brief Add merge data to the message. Similar to addData, this can
      *        be some or all of a message but can include mail merge variables.
@@ -198,10 +297,15 @@ class PMTAMessage : public Nan::ObjectWrap {
      */
     static void addDateHeader(const Nan::FunctionCallbackInfo<v8::Value>& info);
 
+    bool add (PMTARecipient* pRecipient,
+      const pmta::suppression::Index* pSuppression);
+
     const char *mSender;
+    uint32_t    mSuppressed;
 
   private:
     static Nan::Persistent<v8::Function> constructor;
+    static Nan::Persistent<v8::FunctionTemplate> tmpl;
 };
 
 /*!
@@ -215,7 +319,9 @@ class PMTARecipient : public Nan::ObjectWrap {
 
   public:
     static void Init (v8::Local<v8::Object> exports);
-    pmta::submitter::Recipient* mRecipient;
+    static bool IsInstance (v8::Local<v8::Value> pValue);
+    /*! Everything set on the recipient, as for PMTAMessage::mMessage. */
+    pmta::smtp::Recipient* mRecipient;
 
     ~PMTARecipient (void);
 
@@ -255,6 +361,116 @@ class PMTARecipient : public Nan::ObjectWrap {
 
   private:
     static Nan::Persistent<v8::Function> constructor; 
+    static Nan::Persistent<v8::FunctionTemplate> tmpl;
+};
+
+/*!
+ *
+ * \addtogroup accounting PMTA accounting
+ * \brief Reads a PMTA accounting file in column batches.
+ *
+ * Objects derived from this class read the d/b/t/... records PMTA writes to
+ * its CSV accounting files, e.g. to match delivery results back to the job
+ * and envelope ids set with setJobId and setEnvelopeId.
+ */
+class PMTAAccountingReader : public Nan::ObjectWrap {
+
+  public:
+    static void Init (v8::Local<v8::Object> exports);
+    pmta::accounting::Reader* mReader;
+    pmta::accounting::Batch   mBatch;
+
+    ~PMTAAccountingReader (void);
+
+  protected:
+    /*!
+     * \brief Open an accounting file
+     * \param pPath Accounting file path
+     * \param pColumns Columns to return
+     * \param pTypes Record types to return, all if empty
+     * \param pFollow Follow the file as PMTA appends to and rotates it
+     * \param pBatchSize Default number of records per batch
+     */
+    PMTAAccountingReader (const std::string& pPath,
+      const std::vector<pmta::accounting::Column>& pColumns,
+      const std::vector<std::string>& pTypes, bool pFollow,
+      size_t pBatchSize);
+
+    static void New (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Reads the next batch of records.
+     * \param pMaxRows Largest number of records to return (optional)
+     * \return An object { length, offset, columns } where columns maps each
+     *         requested column name to an Array of strings, or to a
+     *         Float64Array for "number" and "time" columns. Returns null
+     *         when no records are available; without `follow` that is the
+     *         end of the file.
+     */
+    static void read (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Closes the file. Later reads return null.
+     */
+    static void close (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    size_t mBatchSize;
+
+  private:
+    static Nan::Persistent<v8::Function> constructor;
+};
+
+/*!
+ *
+ * \addtogroup suppression Suppression index
+ * \brief Represents a suppression list (bounces, complaints, unsubscribes).
+ *
+ * Objects derived from this class look addresses up in an index file built
+ * with SuppressionIndex.build(). Addresses are compared case-insensitively.
+ */
+class PMTASuppressionIndex : public Nan::ObjectWrap {
+
+  public:
+    static void Init (v8::Local<v8::Object> exports);
+    static bool IsInstance (v8::Local<v8::Value> pValue);
+    pmta::suppression::Index* mIndex;
+
+    ~PMTASuppressionIndex (void);
+
+  protected:
+    /*!
+     * \brief Opens a suppression index.
+     * \param pPath Index file written by SuppressionIndex.build()
+     */
+    PMTASuppressionIndex (const char* pPath);
+
+    static void New (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Checks an address against the index.
+     * \param pAddress E-mail address
+     * \return True if the address is suppressed.
+     */
+    static void has (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Number of addresses in the index.
+     */
+    static void size (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+    /*!
+     * \brief Writes an index file. Called on the constructor, i.e.
+     *        SuppressionIndex.build(source, path).
+     * \param pSource Array of addresses, or the path of a text file with one
+     *        address per line
+     * \param pPath Index file to write; replaced atomically if it exists
+     * \return Number of distinct addresses written.
+     */
+    static void build (const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+  private:
+    static Nan::Persistent<v8::Function> constructor;
+    static Nan::Persistent<v8::FunctionTemplate> tmpl;
 };
 
 #endif
@@ -0,0 +1,719 @@
+#include "smtp.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace pmta {
+namespace smtp {
+
+namespace {
+
+/*
+ * Raised when the server goes away underneath us. submit() uses it to tell a
+ * stale pooled connection apart from a real submission failure.
+ */
+class Lost : public Error {
+  public:
+    explicit Lost (const std::string& pWhat) : Error(pWhat, true) {}
+};
+
+/*
+ * Envelope fields are written into command lines and headers as they are. A
+ * CR, LF or NUL would end the line early and let the rest be read as a
+ * command of its own; a '>' would close an address and let the rest be read
+ * as parameters.
+ */
+void check (const std::string& pValue, const char* pWhat, bool pAddress) {
+  for (size_t i = 0; i < pValue.size(); i++) {
+    char c = pValue[i];
+    if (c == '\r' || c == '\n' || c == '\0' || (pAddress && c == '>')) {
+      throw Error(std::string("submit(): ") + pWhat +
+        (pAddress ? " contains CR, LF, NUL or '>'" :
+          " contains CR, LF or NUL"));
+    }
+  }
+}
+
+void check (const Message& pMessage) {
+  check(pMessage.mSender, "sender", true);
+  check(pMessage.mJobId, "job id", false);
+  check(pMessage.mVirtualMta, "virtual MTA", false);
+
+  for (size_t i = 0; i < pMessage.mRecipients.size(); i++) {
+    const Recipient& rcpt = pMessage.mRecipients[i];
+    check(rcpt.mAddress, "recipient", true);
+
+    for (size_t v = 0; v < rcpt.mVariables.size(); v++) {
+      const std::string& name = rcpt.mVariables[v].first;
+      check(name, "variable name", false);
+      if (name.empty() || name.find_first_of(" =") != std::string::npos) {
+        throw Error("submit(): variable name \"" + name + "\" is empty or "
+          "contains a space or '='");
+      }
+      check(rcpt.mVariables[v].second, "variable value", false);
+    }
+  }
+}
+
+std::string base64 (const std::string& pIn) {
+  static const char table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((pIn.size() + 2) / 3 * 4);
+
+  size_t i = 0;
+  for (; i + 2 < pIn.size(); i += 3) {
+    unsigned v = ((unsigned char)pIn[i] << 16) |
+      ((unsigned char)pIn[i + 1] << 8) | (unsigned char)pIn[i + 2];
+    out += table[(v >> 18) & 0x3f];
+    out += table[(v >> 12) & 0x3f];
+    out += table[(v >> 6) & 0x3f];
+    out += table[v & 0x3f];
+  }
+  if (i + 1 == pIn.size()) {
+    unsigned v = (unsigned char)pIn[i] << 16;
+    out += table[(v >> 18) & 0x3f];
+    out += table[(v >> 12) & 0x3f];
+    out += "==";
+  } else if (i + 2 == pIn.size()) {
+    unsigned v = ((unsigned char)pIn[i] << 16) |
+      ((unsigned char)pIn[i + 1] << 8);
+    out += table[(v >> 18) & 0x3f];
+    out += table[(v >> 12) & 0x3f];
+    out += table[(v >> 6) & 0x3f];
+    out += '=';
+  }
+  return out;
+}
+
+/* RFC 3461 xtext, used for ENVID. */
+std::string xtext (const std::string& pIn) {
+  std::string out;
+  char hex[4];
+  for (size_t i = 0; i < pIn.size(); i++) {
+    unsigned char c = pIn[i];
+    if (c < 33 || c > 126 || c == '+' || c == '=') {
+      snprintf(hex, sizeof(hex), "+%02X", c);
+      out += hex;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+std::string quote (const std::string& pIn) {
+  std::string out("\"");
+  for (size_t i = 0; i < pIn.size(); i++) {
+    if (pIn[i] == '"' || pIn[i] == '\\') {
+      out += '\\';
+    }
+    out += pIn[i];
+  }
+  out += '"';
+  return out;
+}
+
+std::string describe (int pCode, const std::string& pText) {
+  char code[8];
+  snprintf(code, sizeof(code), "%d ", pCode);
+  return code + pText;
+}
+
+}
+
+/*
+ * Message
+ */
+
+Message::Message (const std::string& pSender)
+  : mSender(pSender), mParts(1), mEncoding(ENCODING_7BIT),
+    mReturnType(RETURN_DEFAULT), mVerp(false), mMerge(false) {
+}
+
+void Message::addData (const char* pData, size_t pLength, bool pMerge) {
+  std::string& part = mParts.back();
+  if (mRuns.empty() || mRuns.back().mPart != mParts.size() - 1 ||
+    mRuns.back().mMerge != pMerge) {
+    Run run = { mParts.size() - 1, part.size(), pMerge };
+    mRuns.push_back(run);
+  }
+  part.reserve(part.size() + pLength + pLength / 32);
+
+  for (size_t i = 0; i < pLength; i++) {
+    if (pData[i] == '\n' && (part.empty() || part[part.size() - 1] != '\r')) {
+      part += '\r';
+    }
+    part += pData[i];
+  }
+
+  if (pMerge) {
+    mMerge = true;
+  }
+}
+
+void Message::beginPart (int pPart) {
+  if (pPart <= (int)mParts.size()) {
+    throw Error("beginPart(): parts must be started in ascending order");
+  }
+  mParts.resize(pPart);
+}
+
+void Message::addDateHeader (void) {
+  static const char* days[] =
+    { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+
+  char zone[8];
+  strftime(zone, sizeof(zone), "%z", &local);
+
+  char header[64];
+  int length = snprintf(header, sizeof(header),
+    "Date: %s, %d %s %04d %02d:%02d:%02d %s\r\n", days[local.tm_wday],
+    local.tm_mday, months[local.tm_mon], local.tm_year + 1900,
+    local.tm_hour, local.tm_min, local.tm_sec, zone);
+
+  addData(header, length, false);
+}
+
+/*
+ * Connection
+ */
+
+Connection::Connection (const std::string& pHost, int pPort,
+  const std::string& pName, const std::string& pPassword)
+  : mHost(pHost), mPort(pPort), mName(pName), mPassword(pPassword),
+    mChunkSize(1024 * 1024), mTimeout(300), mSocket(-1), mInPos(0),
+    mPending(0), mPipelining(false), mChunking(false), m8BitMime(false),
+    mDsn(false) {
+}
+
+Connection::~Connection (void) {
+  if (mSocket >= 0) {
+    mOut = "QUIT\r\n";
+    ::send(mSocket, mOut.data(), mOut.size(), MSG_NOSIGNAL);
+    disconnect();
+  }
+}
+
+std::vector<std::string> Connection::submit (const Message& pMessage) {
+  if (pMessage.mRecipients.empty()) {
+    throw Error("submit(): message has no recipients");
+  }
+  check(pMessage);
+
+  bool reused = mSocket >= 0;
+  if (!reused) {
+    open();
+  }
+
+  try {
+    return transaction(pMessage);
+  } catch (Lost&) {
+    if (!reused) {
+      throw;
+    }
+  } catch (Error&) {
+    reset();
+    throw;
+  }
+
+  // The server dropped a connection we were holding open; retry once on a
+  // fresh one.
+  open();
+  try {
+    return transaction(pMessage);
+  } catch (Error&) {
+    reset();
+    throw;
+  }
+}
+
+void Connection::close (void) {
+  if (mSocket < 0) {
+    return;
+  }
+  try {
+    mOut += "QUIT\r\n";
+    flush();
+    readReply();
+  } catch (Error&) {
+  }
+  disconnect();
+}
+
+/*
+ * Writes the whole transaction in as few sends as the server allows and
+ * only then looks at the replies, so a rejected command never leaves
+ * unread replies behind on the connection.
+ */
+std::vector<std::string> Connection::transaction (const Message& pMessage) {
+  std::vector<Reply> replies;
+  std::vector<std::string> rejected;
+
+  const std::vector<Recipient>& recipients = pMessage.mRecipients;
+  bool merge = pMessage.mMerge;
+
+  command((merge ? "XMRG FROM:<" : "MAIL FROM:<") + pMessage.mSender + ">" +
+    mailParameters(pMessage), replies);
+
+  for (size_t i = 0; i < recipients.size(); i++) {
+    const Recipient& rcpt = recipients[i];
+    if (merge && !rcpt.mVariables.empty()) {
+      std::string line("XDFN");
+      for (size_t v = 0; v < rcpt.mVariables.size(); v++) {
+        line += ' ';
+        line += rcpt.mVariables[v].first;
+        line += '=';
+        line += quote(rcpt.mVariables[v].second);
+      }
+      command(line, replies);
+    }
+    command("RCPT TO:<" + rcpt.mAddress + ">" + rcptParameters(rcpt),
+      replies);
+  }
+
+  std::string body(headers(pMessage));
+  if (!merge) {
+    for (size_t i = 0; i < pMessage.mParts.size(); i++) {
+      body += pMessage.mParts[i];
+    }
+    if (body.size() < 2 || body.compare(body.size() - 2, 2, "\r\n") != 0) {
+      body += "\r\n";
+    }
+  }
+
+  if (!merge && mChunking) {
+    size_t offset = 0;
+    do {
+      size_t length = body.size() - offset;
+      if (length > mChunkSize) {
+        length = mChunkSize;
+      }
+      bool last = offset + length == body.size();
+
+      char line[48];
+      snprintf(line, sizeof(line), "BDAT %lu%s\r\n", (unsigned long)length,
+        last ? " LAST" : "");
+      mOut += line;
+      mOut.append(body, offset, length);
+      queue(replies);
+
+      offset += length;
+    } while (offset < body.size());
+  } else {
+    // DATA and XPRT must end a pipelined group; the body only follows a 354.
+    size_t parts = merge ? pMessage.mParts.size() : 1;
+    for (size_t p = 0; p < parts; p++) {
+      if (merge) {
+        char line[32];
+        snprintf(line, sizeof(line), "XPRT %lu%s", (unsigned long)(p + 1),
+          p + 1 == parts ? " LAST" : "");
+        command(line, replies);
+        if (p > 0) {
+          body.clear();
+        }
+        body += pMessage.mParts[p];
+      } else {
+        command("DATA", replies);
+      }
+
+      flush();
+      collect(replies);
+      if (replies.back().code != 354) {
+        break;
+      }
+      replies.pop_back();
+
+      appendBody(body, true);
+      mOut += ".\r\n";
+      queue(replies);
+    }
+  }
+
+  flush();
+  collect(replies);
+
+  // Replies are in command order: MAIL, [XDFN] RCPT..., then the data.
+  size_t r = 0;
+  const Reply& mail = replies[r++];
+  if (mail.code / 100 != 2) {
+    throw Error((merge ? "XMRG FROM: " : "MAIL FROM: ") +
+      describe(mail.code, mail.text), mail.code / 100 == 4);
+  }
+
+  bool deferred = false;
+  for (size_t i = 0; i < recipients.size(); i++) {
+    const Recipient& rcpt = recipients[i];
+    if (merge && !rcpt.mVariables.empty()) {
+      const Reply& dfn = replies[r++];
+      if (dfn.code / 100 != 2) {
+        r++;
+        rejected.push_back(rcpt.mAddress + ": " +
+          describe(dfn.code, dfn.text));
+        deferred = deferred || dfn.code / 100 == 4;
+        continue;
+      }
+    }
+    const Reply& to = replies[r++];
+    if (to.code / 100 != 2) {
+      rejected.push_back(rcpt.mAddress + ": " + describe(to.code, to.text));
+      deferred = deferred || to.code / 100 == 4;
+    }
+  }
+
+  if (rejected.size() == recipients.size()) {
+    throw Error("RCPT TO: no recipients accepted; " + rejected[0], deferred);
+  }
+
+  for (; r < replies.size(); r++) {
+    if (replies[r].code / 100 != 2) {
+      throw Error(describe(replies[r].code, replies[r].text),
+        replies[r].code / 100 == 4);
+    }
+  }
+
+  return rejected;
+}
+
+void Connection::open (void) {
+  disconnect();
+
+  char port[16];
+  snprintf(port, sizeof(port), "%d", mPort);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* addresses;
+  int rc = getaddrinfo(mHost.c_str(), port, &hints, &addresses);
+  if (rc != 0) {
+    throw Error(mHost + ": " + gai_strerror(rc), true);
+  }
+
+  int error = 0;
+  for (struct addrinfo* a = addresses; a != NULL; a = a->ai_next) {
+    mSocket = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (mSocket < 0) {
+      error = errno;
+      continue;
+    }
+    if (connect(mSocket, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    error = errno;
+    ::close(mSocket);
+    mSocket = -1;
+  }
+  freeaddrinfo(addresses);
+
+  if (mSocket < 0) {
+    throw Error(mHost + ": " + strerror(error), true);
+  }
+
+  int on = 1;
+  setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  struct timeval tv;
+  tv.tv_sec  = mTimeout;
+  tv.tv_usec = 0;
+  setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(mSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  try {
+    expect(readReply(), 2, "greeting");
+
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+      strcpy(hostname, "localhost");
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    mOut += "EHLO ";
+    mOut += hostname;
+    mOut += "\r\n";
+    flush();
+    Reply ehlo = readReply();
+    expect(ehlo, 2, "EHLO");
+
+    mPipelining = mChunking = m8BitMime = mDsn = false;
+    bool auth = false;
+    size_t start = 0;
+    while (start < ehlo.text.size()) {
+      size_t end = ehlo.text.find('\n', start);
+      if (end == std::string::npos) {
+        end = ehlo.text.size();
+      }
+      std::string keyword(ehlo.text, start, end - start);
+      keyword = keyword.substr(0, keyword.find(' '));
+      for (size_t i = 0; i < keyword.size(); i++) {
+        keyword[i] = toupper((unsigned char)keyword[i]);
+      }
+
+      if (keyword == "PIPELINING") {
+        mPipelining = true;
+      } else if (keyword == "CHUNKING") {
+        mChunking = true;
+      } else if (keyword == "8BITMIME") {
+        m8BitMime = true;
+      } else if (keyword == "DSN") {
+        mDsn = true;
+      } else if (keyword == "AUTH") {
+        auth = true;
+      }
+      start = end + 1;
+    }
+
+    if (!mName.empty()) {
+      if (!auth) {
+        throw Error("AUTH: not offered by server");
+      }
+      std::string credentials;
+      credentials += '\0';
+      credentials += mName;
+      credentials += '\0';
+      credentials += mPassword;
+
+      mOut += "AUTH PLAIN " + base64(credentials) + "\r\n";
+      flush();
+      expect(readReply(), 2, "AUTH");
+    }
+  } catch (Error&) {
+    disconnect();
+    throw;
+  }
+}
+
+void Connection::reset (void) {
+  if (mSocket < 0) {
+    return;
+  }
+  try {
+    mOut += "RSET\r\n";
+    flush();
+    if (readReply().code / 100 != 2) {
+      disconnect();
+    }
+  } catch (Error&) {
+    disconnect();
+  }
+}
+
+void Connection::disconnect (void) {
+  if (mSocket >= 0) {
+    ::close(mSocket);
+    mSocket = -1;
+  }
+  mOut.clear();
+  mIn.clear();
+  mInPos   = 0;
+  mPending = 0;
+}
+
+void Connection::command (const std::string& pLine,
+  std::vector<Reply>& pReplies) {
+  mOut += pLine;
+  mOut += "\r\n";
+  queue(pReplies);
+}
+
+void Connection::queue (std::vector<Reply>& pReplies) {
+  mPending++;
+  if (!mPipelining) {
+    flush();
+    collect(pReplies);
+  }
+}
+
+void Connection::collect (std::vector<Reply>& pReplies) {
+  for (; mPending > 0; mPending--) {
+    pReplies.push_back(readReply());
+  }
+}
+
+void Connection::flush (void) {
+  size_t sent = 0;
+  while (sent < mOut.size()) {
+    ssize_t n = ::send(mSocket, mOut.data() + sent, mOut.size() - sent,
+      MSG_NOSIGNAL);
+    if (n < 0) {
+      int error = errno;
+      if (error == EINTR) {
+        continue;
+      }
+      disconnect();
+      if (error == EPIPE || error == ECONNRESET) {
+        throw Lost(mHost + ": " + strerror(error));
+      }
+      throw Error(mHost + ": " + strerror(error), true);
+    }
+    sent += n;
+  }
+  mOut.clear();
+}
+
+Connection::Reply Connection::readReply (void) {
+  Reply reply;
+  reply.code = 0;
+
+  for (;;) {
+    size_t eol = mIn.find("\r\n", mInPos);
+    if (eol == std::string::npos) {
+      if (mInPos > 0) {
+        mIn.erase(0, mInPos);
+        mInPos = 0;
+      }
+
+      char buffer[4096];
+      ssize_t n = ::recv(mSocket, buffer, sizeof(buffer), 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        int error = n < 0 ? errno : 0;
+        disconnect();
+        if (n == 0 || error == ECONNRESET) {
+          throw Lost(mHost + ": connection closed by server");
+        }
+        throw Error(mHost + ": " + strerror(error), true);
+      }
+      mIn.append(buffer, n);
+      continue;
+    }
+
+    if (eol - mInPos < 3) {
+      disconnect();
+      throw Error(mHost + ": malformed reply", true);
+    }
+
+    if (!reply.text.empty()) {
+      reply.text += '\n';
+    }
+    reply.code = atoi(mIn.c_str() + mInPos);
+    bool more = eol - mInPos > 3 && mIn[mInPos + 3] == '-';
+    if (eol - mInPos > 4) {
+      reply.text.append(mIn, mInPos + 4, eol - mInPos - 4);
+    }
+    mInPos = eol + 2;
+
+    if (!more) {
+      break;
+    }
+  }
+
+  if (reply.code == 421) {
+    disconnect();
+    throw Lost(describe(reply.code, reply.text));
+  }
+  return reply;
+}
+
+void Connection::expect (const Reply& pReply, int pClass, const char* pWhat) {
+  if (pReply.code / 100 != pClass) {
+    throw Error(std::string(pWhat) + ": " +
+      describe(pReply.code, pReply.text), pReply.code / 100 == 4);
+  }
+}
+
+std::string Connection::mailParameters (const Message& pMessage) const {
+  std::string params;
+  if (pMessage.mVerp) {
+    params += " VERP";
+  }
+  if (pMessage.mEncoding != ENCODING_7BIT && m8BitMime) {
+    params += " BODY=8BITMIME";
+  }
+  if (mDsn) {
+    if (pMessage.mReturnType == RETURN_FULL) {
+      params += " RET=FULL";
+    } else if (pMessage.mReturnType == RETURN_HEADERS) {
+      params += " RET=HDRS";
+    }
+    if (!pMessage.mEnvelopeId.empty()) {
+      params += " ENVID=" + xtext(pMessage.mEnvelopeId);
+    }
+  }
+  return params;
+}
+
+std::string Connection::rcptParameters (const Recipient& pRecipient) const {
+  if (!mDsn || !pRecipient.mNotifySet) {
+    return "";
+  }
+  // Bits outside the mask have no keyword; without this a value made only
+  // of them would leave params empty below.
+  int notify = pRecipient.mNotify & NOTIFY_MASK;
+  if (notify == NOTIFY_NEVER) {
+    return " NOTIFY=NEVER";
+  }
+
+  std::string params;
+  if (notify & NOTIFY_SUCCESS) {
+    params += ",SUCCESS";
+  }
+  if (notify & NOTIFY_FAILURE) {
+    params += ",FAILURE";
+  }
+  if (notify & NOTIFY_DELAY) {
+    params += ",DELAY";
+  }
+  params[0] = '=';
+  return " NOTIFY" + params;
+}
+
+/*
+ * PMTA takes the virtual MTA and job id from these headers and strips them
+ * before delivery; they stand in for setVirtualMta()/setJobId() on the API.
+ */
+std::string Connection::headers (const Message& pMessage) const {
+  std::string out;
+  if (!pMessage.mVirtualMta.empty()) {
+    out += "x-virtual-mta: " + pMessage.mVirtualMta + "\r\n";
+  }
+  if (!pMessage.mJobId.empty()) {
+    out += "x-job: " + pMessage.mJobId + "\r\n";
+  }
+  return out;
+}
+
+void Connection::appendBody (const std::string& pPart, bool pDotStuff) {
+  mOut.reserve(mOut.size() + pPart.size() + 8);
+
+  bool bol = true;
+  for (size_t i = 0; i < pPart.size(); i++) {
+    char c = pPart[i];
+    if (bol && c == '.' && pDotStuff) {
+      mOut += '.';
+    }
+    mOut += c;
+    bol = c == '\n' && i > 0 && pPart[i - 1] == '\r';
+  }
+
+  if (!bol) {
+    mOut += "\r\n";
+  }
+}
+
+}
+}
@@ -0,0 +1,237 @@
+/*! \file smtp.h Native ESMTP submission transport for node-pmta.
+ *
+ * <div class="license">
+ * Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * </div>
+ */
+#ifndef PMTA_SMTP_H
+#define PMTA_SMTP_H
+
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pmta {
+namespace smtp {
+
+/*!
+ * \brief Thrown for any failed SMTP exchange. what() carries the server
+ *        reply (or the local error) that caused the failure.
+ *
+ * temporary() is true when the connection failed or timed out or the
+ * server answered 4xx, i.e. when the same message may go through later; it
+ * is false for 5xx replies and for errors in the message itself.
+ */
+class Error : public std::runtime_error {
+  public:
+    explicit Error (const std::string& pWhat, bool pTemporary = false)
+      : std::runtime_error(pWhat), mTemporary(pTemporary) {}
+
+    bool temporary (void) const { return mTemporary; }
+
+  private:
+    bool mTemporary;
+};
+
+enum Encoding {
+  ENCODING_7BIT,
+  ENCODING_8BIT,
+  ENCODING_BASE64
+};
+
+enum ReturnType {
+  RETURN_DEFAULT,
+  RETURN_FULL,
+  RETURN_HEADERS
+};
+
+/*! Mirrors PmtaRcptNOTIFY_*. */
+enum {
+  NOTIFY_NEVER   = 0x00,
+  NOTIFY_SUCCESS = 0x01,
+  NOTIFY_FAILURE = 0x02,
+  NOTIFY_DELAY   = 0x04,
+  NOTIFY_MASK    = NOTIFY_SUCCESS | NOTIFY_FAILURE | NOTIFY_DELAY
+};
+
+/*!
+ * \addtogroup smtp SMTP transport
+ * \brief Envelope recipient as sent over SMTP.
+ *
+ * Variables are sent with XDFN ahead of the RCPT command when the owning
+ * message contains merge data.
+ */
+struct Recipient {
+  Recipient (const std::string& pAddress)
+    : mAddress(pAddress), mNotify(NOTIFY_NEVER), mNotifySet(false) {}
+
+  std::string mAddress;
+  std::vector<std::pair<std::string, std::string> > mVariables;
+  int  mNotify;
+  bool mNotifySet;
+};
+
+/*!
+ * \brief Message as sent over SMTP.
+ *
+ * Data is stored already normalized to CRLF line endings, one string per
+ * part (see beginPart()). A message becomes a merge message, submitted with
+ * XMRG/XDFN/XPRT instead of MAIL/RCPT/BDAT, as soon as any merge data is
+ * added to it.
+ *
+ * This is also the only copy PMTAMessage keeps for the "api" transport;
+ * mRuns records which data was added as merge data so the libpmta message
+ * can be built from it at submit time.
+ */
+struct Message {
+  /*! Data added by consecutive calls of the same kind to one part. */
+  struct Run {
+    size_t mPart;
+    size_t mOffset;   /*!< Where the run starts in mParts[mPart] */
+    bool   mMerge;
+  };
+
+  Message (const std::string& pSender);
+
+  /*!
+   * \brief Append data to the current part.
+   * \param pData Data to append; bare LF line endings are converted.
+   * \param pLength Number of bytes of pData to use.
+   * \param pMerge True if the data may contain [variable] references.
+   */
+  void addData (const char* pData, size_t pLength, bool pMerge);
+
+  /*!
+   * \brief Start part pPart. Parts must be started in ascending order.
+   */
+  void beginPart (int pPart);
+
+  /*!
+   * \brief Append an RFC 5322 Date header for the current time.
+   */
+  void addDateHeader (void);
+
+  std::string mSender;
+  std::vector<Recipient> mRecipients;
+  std::vector<std::string> mParts;
+  std::vector<Run> mRuns;
+  std::string mJobId;
+  std::string mEnvelopeId;
+  std::string mVirtualMta;
+  Encoding   mEncoding;
+  ReturnType mReturnType;
+  bool mVerp;
+  bool mMerge;
+};
+
+/*!
+ * \brief A persistent ESMTP connection to a PMTA SMTP listener.
+ *
+ * The connection is opened on the first submit() and reused for later
+ * ones. When the server advertises PIPELINING the whole envelope and the
+ * message body are written with a single send and the replies are read
+ * back afterwards; when it advertises CHUNKING the body is sent with BDAT
+ * so it needs no dot-stuffing. A reused connection that turns out to have
+ * been closed by the server is reopened once and the message retried.
+ */
+class Connection {
+
+  public:
+    /*!
+     * \brief Create a connection. Nothing is opened until the first submit.
+     * \param pHost PMTA hostname or address
+     * \param pPort PMTA SMTP port
+     * \param pName AUTH PLAIN user name, empty for none
+     * \param pPassword AUTH PLAIN password
+     */
+    Connection (const std::string& pHost, int pPort,
+      const std::string& pName = "", const std::string& pPassword = "");
+
+    ~Connection (void);
+
+    /*!
+     * \brief Submit a message.
+     * \param pMessage Message to submit
+     * \return Recipients refused by the server, as "address: reply". The
+     *         message was accepted for every other recipient.
+     * \throws Error if the message was not accepted at all.
+     */
+    std::vector<std::string> submit (const Message& pMessage);
+
+    /*!
+     * \brief Send QUIT and close the socket, if open.
+     */
+    void close (void);
+
+    /*!
+     * \brief Largest BDAT chunk to send. Defaults to 1 MiB.
+     */
+    void setChunkSize (size_t pChunkSize) { mChunkSize = pChunkSize; }
+
+    /*!
+     * \brief Socket send/receive timeout in seconds. Defaults to 300.
+     */
+    void setTimeout (int pSeconds) { mTimeout = pSeconds; }
+
+  private:
+    struct Reply {
+      int code;
+      std::string text;
+    };
+
+    std::vector<std::string> transaction (const Message& pMessage);
+
+    void open (void);
+    void reset (void);
+    void disconnect (void);
+
+    void command (const std::string& pLine, std::vector<Reply>& pReplies);
+    void queue (std::vector<Reply>& pReplies);
+    void collect (std::vector<Reply>& pReplies);
+    void flush (void);
+    Reply readReply (void);
+    void expect (const Reply& pReply, int pClass, const char* pWhat);
+
+    std::string mailParameters (const Message& pMessage) const;
+    std::string rcptParameters (const Recipient& pRecipient) const;
+    std::string headers (const Message& pMessage) const;
+    void appendBody (const std::string& pPart, bool pDotStuff);
+
+    std::string mHost;
+    int         mPort;
+    std::string mName;
+    std::string mPassword;
+    size_t      mChunkSize;
+    int         mTimeout;
+
+    int         mSocket;
+    std::string mOut;
+    std::string mIn;
+    size_t      mInPos;
+    size_t      mPending;
+
+    bool mPipelining;
+    bool mChunking;
+    bool m8BitMime;
+    bool mDsn;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,310 @@
+#include "suppression.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace pmta {
+namespace suppression {
+
+namespace {
+
+/*
+ * Index file layout, all in host byte order:
+ *
+ *   Header            64 bytes
+ *   Bloom filter      mBlocks 64-byte blocks
+ *   Directory         (1 << directoryBits) + 1 uint32 offsets into the hashes
+ *   (padding to 8)
+ *   Hashes            count sorted uint64
+ */
+const char     kMagic[8]     = { 'P', 'M', 'T', 'A', 'S', 'U', 'P', '1' };
+const uint32_t kVersion      = 1;
+const unsigned kBloomBits    = 12;    // per address
+const unsigned kBloomProbes  = 7;     // 9-bit positions within a block
+const unsigned kBucketSize   = 16;    // target hashes per directory bucket
+
+struct Header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t directoryBits;
+  uint64_t count;
+  uint64_t blocks;
+  char     reserved[32];
+};
+
+inline uint64_t rotl (uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix (uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Lower-cases the ASCII letters of eight bytes at once. */
+inline uint64_t lower8 (uint64_t w) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  uint64_t heptets = w & (0x7f * ones);
+  uint64_t atLeastA = heptets + (0x80 - 'A') * ones;
+  uint64_t aboveZ   = heptets + (0x80 - 'Z' - 1) * ones;
+  uint64_t upper    = (atLeastA ^ aboveZ) & ~w & (0x80 * ones);
+  return w | (upper >> 2);
+}
+
+inline bool space (char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline size_t directoryOffset (uint64_t pBlocks) {
+  return sizeof(Header) + pBlocks * 64;
+}
+
+inline size_t hashesOffset (uint64_t pBlocks, uint32_t pBits) {
+  size_t end = directoryOffset(pBlocks) +
+    (((size_t)1 << pBits) + 1) * sizeof(uint32_t);
+  return (end + 7) & ~(size_t)7;
+}
+
+/* The block and the bit positions within it an address hash maps to. */
+inline const uint64_t* bloomBlock (const uint64_t* pBloom, uint64_t pBlocks,
+  uint64_t pHash, uint64_t& pBits) {
+  uint64_t m = fmix(pHash ^ 0x9e3779b97f4a7c15ULL);
+  pBits = m * 0x9e3779b97f4a7c15ULL;
+  return pBloom + (((m >> 32) * pBlocks) >> 32) * 8;
+}
+
+}
+
+uint64_t hash (const char* pAddress, size_t pLength) {
+  const char* p = pAddress;
+  size_t      n = pLength;
+
+  while (n > 0 && space(p[0])) {
+    p++;
+    n--;
+  }
+  while (n > 0 && space(p[n - 1])) {
+    n--;
+  }
+
+  uint64_t h = 0x243f6a8885a308d3ULL ^ n;
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = rotl(h ^ (lower8(w) * 0x87c37b91114253d5ULL), 31) *
+      0x4cf5ad432745937fULL;
+  }
+  if (n > 0) {
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h = rotl(h ^ (lower8(w) * 0x87c37b91114253d5ULL), 31) *
+      0x4cf5ad432745937fULL;
+  }
+  return fmix(h);
+}
+
+/*
+ * Builder
+ */
+
+void Builder::add (const char* pAddress, size_t pLength) {
+  mHashes.push_back(hash(pAddress, pLength));
+}
+
+void Builder::addFile (const std::string& pPath) {
+  FILE* in = fopen(pPath.c_str(), "r");
+  if (in == NULL) {
+    throw Error(pPath + ": " + strerror(errno));
+  }
+
+  char*   line     = NULL;
+  size_t  capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, in)) >= 0) {
+    const char* p = line;
+    while (length > 0 && space(*p)) {
+      p++;
+      length--;
+    }
+    if (length > 0 && *p != '#') {
+      add(p, length);
+    }
+  }
+
+  bool failed = ferror(in) != 0;
+  free(line);
+  fclose(in);
+  if (failed) {
+    throw Error(pPath + ": read error");
+  }
+}
+
+uint64_t Builder::write (const std::string& pPath) {
+  std::sort(mHashes.begin(), mHashes.end());
+  mHashes.erase(std::unique(mHashes.begin(), mHashes.end()), mHashes.end());
+
+  uint64_t count = mHashes.size();
+  if (count > 0xffffffffULL) {
+    throw Error("suppression index: too many addresses");
+  }
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version       = kVersion;
+  header.directoryBits = 0;
+  while ((count >> header.directoryBits) > kBucketSize) {
+    header.directoryBits++;
+  }
+  header.count  = count;
+  header.blocks = (count * kBloomBits + 511) / 512;
+  if (header.blocks == 0) {
+    header.blocks = 1;
+  }
+
+  std::vector<uint64_t> bloom(header.blocks * 8);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t bits;
+    uint64_t* block = const_cast<uint64_t*>(
+      bloomBlock(&bloom[0], header.blocks, mHashes[i], bits));
+    for (unsigned k = 0; k < kBloomProbes; k++, bits >>= 9) {
+      block[(bits & 511) >> 6] |= (uint64_t)1 << (bits & 63);
+    }
+  }
+
+  size_t buckets = (size_t)1 << header.directoryBits;
+  std::vector<uint32_t> directory(buckets + 1);
+  uint64_t h = 0;
+  for (size_t b = 0; b < buckets; b++) {
+    directory[b] = h;
+    while (h < count && (header.directoryBits == 0 ? 0 :
+      mHashes[h] >> (64 - header.directoryBits)) == b) {
+      h++;
+    }
+  }
+  directory[buckets] = count;
+
+  size_t padding = hashesOffset(header.blocks, header.directoryBits) -
+    directoryOffset(header.blocks) - directory.size() * sizeof(uint32_t);
+  const uint64_t zero = 0;
+
+  std::string temporary = pPath + ".tmp";
+  FILE* out = fopen(temporary.c_str(), "wb");
+  if (out == NULL) {
+    throw Error(temporary + ": " + strerror(errno));
+  }
+
+  bool ok =
+    fwrite(&header, sizeof(header), 1, out) == 1 &&
+    fwrite(&bloom[0], sizeof(uint64_t), bloom.size(), out) == bloom.size() &&
+    fwrite(&directory[0], sizeof(uint32_t), directory.size(), out) ==
+      directory.size() &&
+    fwrite(&zero, 1, padding, out) == padding &&
+    (count == 0 ||
+      fwrite(&mHashes[0], sizeof(uint64_t), count, out) == count);
+  ok = fclose(out) == 0 && ok;
+
+  if (!ok || rename(temporary.c_str(), pPath.c_str()) != 0) {
+    int error = errno;
+    unlink(temporary.c_str());
+    throw Error(pPath + ": " + strerror(error));
+  }
+
+  mHashes.clear();
+  return count;
+}
+
+/*
+ * Index
+ */
+
+Index::Index (const std::string& pPath)
+  : mMap(NULL), mMapped(0), mCount(0), mBlocks(0), mShift(64),
+    mBloom(NULL), mDirectory(NULL), mHashes(NULL) {
+  int fd = open(pPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw Error(pPath + ": " + strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    throw Error(pPath + ": " + strerror(error));
+  }
+  if ((size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    throw Error(pPath + ": not a suppression index");
+  }
+
+  mMapped = st.st_size;
+  mMap    = mmap(NULL, mMapped, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mMap == MAP_FAILED) {
+    mMap = NULL;
+    throw Error(pPath + ": " + strerror(errno));
+  }
+
+  const Header* header = static_cast<const Header*>(mMap);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+    header->version != kVersion || header->directoryBits > 32 ||
+    header->blocks == 0 ||
+    hashesOffset(header->blocks, header->directoryBits) +
+      header->count * sizeof(uint64_t) != mMapped) {
+    munmap(mMap, mMapped);
+    mMap = NULL;
+    throw Error(pPath + ": not a suppression index");
+  }
+
+  const char* base = static_cast<const char*>(mMap);
+  mCount     = header->count;
+  mBlocks    = header->blocks;
+  mShift     = 64 - header->directoryBits;
+  mBloom     = reinterpret_cast<const uint64_t*>(base + sizeof(Header));
+  mDirectory = reinterpret_cast<const uint32_t*>(
+    base + directoryOffset(mBlocks));
+  mHashes    = reinterpret_cast<const uint64_t*>(
+    base + hashesOffset(mBlocks, header->directoryBits));
+
+  madvise(mMap, mMapped, MADV_RANDOM);
+}
+
+Index::~Index (void) {
+  if (mMap != NULL) {
+    munmap(mMap, mMapped);
+  }
+}
+
+bool Index::has (const char* pAddress, size_t pLength) const {
+  return hasHash(hash(pAddress, pLength));
+}
+
+bool Index::hasHash (uint64_t pHash) const {
+  uint64_t bits;
+  const uint64_t* block = bloomBlock(mBloom, mBlocks, pHash, bits);
+  for (unsigned k = 0; k < kBloomProbes; k++, bits >>= 9) {
+    if ((block[(bits & 511) >> 6] & ((uint64_t)1 << (bits & 63))) == 0) {
+      return false;
+    }
+  }
+
+  uint64_t bucket = mShift >= 64 ? 0 : pHash >> mShift;
+  const uint64_t* first = mHashes + mDirectory[bucket];
+  const uint64_t* last  = mHashes + mDirectory[bucket + 1];
+  const uint64_t* found = std::lower_bound(first, last, pHash);
+  return found != last && *found == pHash;
+}
+
+}
+}
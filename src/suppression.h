@@ -0,0 +1,113 @@
+/*! \file suppression.h Memory-mapped suppression list lookups.
+ *
+ * <div class="license">
+ * Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * </div>
+ */
+#ifndef PMTA_SUPPRESSION_H
+#define PMTA_SUPPRESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace pmta {
+namespace suppression {
+
+/*!
+ * \brief Thrown when an index cannot be built, opened or is not valid.
+ */
+class Error : public std::runtime_error {
+  public:
+    explicit Error (const std::string& pWhat) : std::runtime_error(pWhat) {}
+};
+
+/*!
+ * \brief 64-bit hash of an address, after trimming surrounding white space
+ *        and lower-casing ASCII letters. This is what the index stores.
+ */
+uint64_t hash (const char* pAddress, size_t pLength);
+
+/*!
+ * \addtogroup suppression Suppression index
+ * \brief Collects address hashes and writes them out as an index file.
+ */
+class Builder {
+
+  public:
+    void add (const char* pAddress, size_t pLength);
+
+    /*!
+     * \brief Add every line of a text file; blank lines and lines starting
+     *        with '#' are skipped.
+     */
+    void addFile (const std::string& pPath);
+
+    /*!
+     * \brief Sort, de-duplicate and write the index. The file is written
+     *        under a temporary name and renamed into place, so processes
+     *        that have the previous index open are not disturbed.
+     * \return Number of distinct addresses written.
+     */
+    uint64_t write (const std::string& pPath);
+
+  private:
+    std::vector<uint64_t> mHashes;
+};
+
+/*!
+ * \brief A read-only suppression index.
+ *
+ * The file is memory-mapped and used in place, so opening it is immediate
+ * whatever its size. It holds a blocked Bloom filter, a directory keyed by
+ * the top bits of the hash and the sorted hashes themselves. A lookup for an
+ * address that is not suppressed, the usual case, normally touches a single
+ * cache line of the filter; the others are settled by a short search of one
+ * directory bucket. Two distinct addresses only collide if their 64-bit
+ * hashes are equal.
+ */
+class Index {
+
+  public:
+    explicit Index (const std::string& pPath);
+    ~Index (void);
+
+    bool has (const char* pAddress, size_t pLength) const;
+    bool hasHash (uint64_t pHash) const;
+
+    uint64_t size (void) const { return mCount; }
+
+  private:
+    Index (const Index&);
+    Index& operator= (const Index&);
+
+    void*           mMap;
+    size_t          mMapped;
+    uint64_t        mCount;
+    uint64_t        mBlocks;
+    uint32_t        mShift;
+    const uint64_t* mBloom;
+    const uint32_t* mDirectory;
+    const uint64_t* mHashes;
+};
+
+}
+}
+
+#endif
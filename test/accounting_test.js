@@ -0,0 +1,157 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Using this test script
+ *
+ * Writes a small accounting file to the system temp directory and reads it
+ * back with AccountingReader, first in one pass (also with blank lines and
+ * records ahead of the header) and then following it while records are
+ * appended, the file is rotated and it is truncated in place, including
+ * while another process keeps truncating and rewriting it. No PMTA
+ * installation is needed.
+ *
+ *   cd test
+ *   node accounting_test
+ */
+var assert        = require('assert');
+var child_process = require('child_process');
+var fs            = require('fs');
+var os            = require('os');
+var path          = require('path');
+var pmta          = require('../index.js');
+
+var file = path.join(os.tmpdir(), "pmta-acct-" + process.pid + ".csv");
+
+var header = "type,timeLogged,orig,rcpt,dsnStatus,dsnDiag,dlvSize,jobId," +
+  "envId\n";
+
+fs.writeFileSync(file, header +
+  "d,2015-06-01 13:45:10-0400,a@domain.tld,jane@domain.tld,2.0.0 (success)," +
+    "\"smtp;250 ok, queued as \"\"A1\"\"\",1234,00000999,env1\n" +
+  "t,2015-06-01 13:45:11-0400,a@domain.tld,joe@domain.tld,4.0.0,,,00000999," +
+    "env2\n" +
+  "b,2015-06-01 13:45:12-0400,a@domain.tld,bob@domain.tld,5.1.1,,,00000999," +
+    "env3\n");
+
+var columns = [
+  "type",
+  "rcpt",
+  "dsnDiag",
+  "jobId",
+  { name: "timeLogged", type: "time" },
+  { name: "dlvSize", type: "number" }
+];
+
+// One pass, delivery and bounce records only.
+var reader = new pmta.AccountingReader(file,
+  { columns: columns, types: [ "d", "b" ] });
+var batch  = reader.read();
+
+assert.equal(batch.length, 2);
+assert.deepEqual(batch.columns.type, [ "d", "b" ]);
+assert.deepEqual(batch.columns.rcpt, [ "jane@domain.tld", "bob@domain.tld" ]);
+assert.equal(batch.columns.dsnDiag[0], "smtp;250 ok, queued as \"A1\"");
+assert.deepEqual(batch.columns.jobId, [ "00000999", "00000999" ]);
+assert.ok(batch.columns.timeLogged instanceof Float64Array);
+assert.equal(batch.columns.timeLogged[0],
+  Date.parse("2015-06-01T13:45:10-04:00"));
+assert.equal(batch.columns.dlvSize[0], 1234);
+assert.ok(isNaN(batch.columns.dlvSize[1]));
+assert.strictEqual(reader.read(), null);
+reader.close();
+
+// Blank lines, with either line ending, are not records, and records ahead
+// of the first header are skipped.
+var sparse = path.join(os.tmpdir(), "pmta-acct-" + process.pid + "-b.csv");
+fs.writeFileSync(sparse, "d,early@domain.tld\n\r\n" +
+  "type,rcpt\n\nd,jane@domain.tld\r\n\r\n\n");
+
+reader = new pmta.AccountingReader(sparse, { columns: [ "type", "rcpt" ] });
+batch  = reader.read();
+assert.equal(batch.length, 1);
+assert.deepEqual(batch.columns.rcpt, [ "jane@domain.tld" ]);
+assert.strictEqual(reader.read(), null);
+reader.close();
+fs.unlinkSync(sparse);
+
+// Follow: appended records, a partial line, then rotation.
+var follow = new pmta.AccountingReader(file,
+  { columns: [ "rcpt" ], follow: true, batchSize: 2 });
+
+assert.deepEqual(follow.read().columns.rcpt,
+  [ "jane@domain.tld", "joe@domain.tld" ]);
+assert.deepEqual(follow.read().columns.rcpt, [ "bob@domain.tld" ]);
+assert.strictEqual(follow.read(), null);
+fs.appendFileSync(file, "\n\r\n");
+assert.strictEqual(follow.read(), null);
+
+fs.appendFileSync(file, "d,2015-06-01 13:45:13-0400,a@domain.tld,amy@");
+assert.strictEqual(follow.read(), null);
+fs.appendFileSync(file, "domain.tld,2.0.0,,1,00000999,env4\n");
+assert.deepEqual(follow.read().columns.rcpt, [ "amy@domain.tld" ]);
+
+fs.renameSync(file, file + ".1");
+fs.writeFileSync(file, "type,rcpt\nd,new@domain.tld\n");
+assert.deepEqual(follow.read().columns.rcpt, [ "new@domain.tld" ]);
+assert.strictEqual(follow.read(), null);
+
+// Truncated in place (copytruncate), then written again.
+fs.appendFileSync(file, "d,more@domain.tld\n");
+assert.deepEqual(follow.read().columns.rcpt, [ "more@domain.tld" ]);
+fs.truncateSync(file, 0);
+assert.strictEqual(follow.read(), null);
+fs.appendFileSync(file, "type,rcpt\nd,after@domain.tld\n");
+assert.deepEqual(follow.read().columns.rcpt, [ "after@domain.tld" ]);
+follow.close();
+
+// Truncated while being read: another process keeps rewriting the file.
+// Every record read must be intact, and the process must survive.
+var rewriter = child_process.spawn(process.execPath, [ "-e",
+  "var fs = require('fs'), end = Date.now() + 1000;" +
+  "var rec = new Array(2001).join('d,someone@domain.tld\\n');" +
+  "while (Date.now() < end) {" +
+  "  fs.writeFileSync(process.argv[1], 'type,rcpt\\n');" +
+  "  for (var i = 0; i < 20; i++) fs.appendFileSync(process.argv[1], rec);" +
+  "}", file ], { stdio: "inherit" });
+
+var racing  = new pmta.AccountingReader(file,
+  { columns: [ "rcpt" ], follow: true, batchSize: 5000 });
+var running = true;
+var rows    = 0;
+
+rewriter.on('exit', function (code) {
+  assert.equal(code, 0);
+  running = false;
+});
+
+(function poll () {
+  var b;
+  while ((b = racing.read()) !== null) {
+    b.columns.rcpt.forEach(function (rcpt) {
+      assert.equal(rcpt, "someone@domain.tld");
+    });
+    rows += b.length;
+  }
+  if (running) {
+    setImmediate(poll);
+    return;
+  }
+  racing.close();
+  assert.ok(rows > 0);
+
+  fs.unlinkSync(file);
+  fs.unlinkSync(file + ".1");
+  console.log("accounting: ok");
+})();
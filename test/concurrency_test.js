@@ -0,0 +1,228 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Using this test script
+ *
+ * Keeps a queue of submitAsync() calls full against the stand-in SMTP server
+ * (smtp_standin.js) while changing how long it takes to acknowledge each
+ * message, and checks that the concurrency limit follows: up while latency
+ * is steady, down when it rises or messages fail temporarily, and up again
+ * once things recover, with no more connections open than the limit needs.
+ * Permanent failures and messages with no recipients must leave it alone.
+ * It then runs again in a child process with the default thread pool of 4
+ * and checks that the limit stays below the pool size rather than climbing
+ * to its maximum. No PMTA installation is needed.
+ *
+ *   cd test
+ *   node concurrency_test [phase seconds]
+ */
+var defaultPool = process.argv[3] === "--default-pool";
+
+// Each submission in flight occupies a thread pool thread.
+if (!defaultPool) {
+  process.env.UV_THREADPOOL_SIZE = 32;
+}
+
+var assert        = require('assert');
+var child_process = require('child_process');
+var path          = require('path');
+var pmta          = require('../index.js');
+
+var seconds = process.argv[2] || "2";
+var phase   = parseFloat(seconds) * 1000;
+
+var standin = child_process.fork(path.join(__dirname, "smtp_standin.js"),
+  [ "0", "--latency", "5" ]);
+
+var connections = [];
+
+standin.on('message', function (m) {
+  if (m.listening) {
+    run(m.listening);
+  }
+  if (m.connections !== undefined) {
+    connections.push(m.connections);
+  }
+});
+
+function run (port) {
+  var cn = new pmta.Connection("127.0.0.1", port, undefined, undefined, {
+    transport   : pmta.PmtaTransportSMTP,
+    concurrency : defaultPool ? { initial: 2 } :
+      { initial: 2, min: 1, max: 24 }
+  });
+
+  var body = "Subject: concurrency\n\nHello.\n";
+  var msg  = new pmta.Message("test@domain.tld");
+  msg.addRecipient(new pmta.Recipient("jane@domain.tld"));
+  msg.addData(body, body.length);
+
+  var none = new pmta.Message("test@domain.tld");
+  none.addData(body, body.length);
+
+  var running   = true;
+  var permanent = false;
+  var alternate = 0;
+  var submitted = 0;
+  var failed    = 0;
+  var latencies = 0;
+  var peak      = 0;
+
+  function done (res) {
+    if (res.submitted) {
+      submitted++;
+    } else {
+      failed++;
+    }
+    assert.equal(typeof res.latency, "number");
+    latencies += res.latency;
+    peak = Math.max(peak, cn.concurrency().limit);
+    fill();
+  }
+
+  function fill () {
+    while (running && cn.concurrency().queued < 32) {
+      cn.submitAsync(permanent && ++alternate % 2 ? none : msg, done);
+    }
+  }
+
+  function report (name) {
+    var c = cn.concurrency();
+    console.log("concurrency: " + name + ": limit " + c.limit + ", " +
+      c.inFlight + " in flight, latency " + c.latency.toFixed(1) +
+      " ms (baseline " + c.baseline.toFixed(1) + " ms)");
+    return c;
+  }
+
+  var steady, slow, failing, after;
+  var steps = [
+    // Latency stays at its baseline: the limit grows.
+    function () {
+      steady = report("steady");
+      assert.ok(steady.limit > 2, "limit did not grow");
+      assert.ok(steady.baseline > 0 && steady.baseline < 50);
+      standin.send({ latency: 50 });
+    },
+    // Latency ten times the baseline: the limit backs off.
+    function () {
+      slow = report("slow");
+      assert.ok(slow.limit < steady.limit, "limit did not fall on latency");
+      standin.send({ latency: 5 });
+    },
+    // Back to normal: the limit grows again.
+    function () {
+      var recovered = report("recovered");
+      assert.ok(recovered.limit > slow.limit, "limit did not recover");
+      standin.send({ reject: true });
+    },
+    // Every message fails: the limit drops to its minimum, and the
+    // connections it no longer needs are closed.
+    function () {
+      failing = report("failing");
+      assert.ok(failed > 0);
+      assert.equal(failing.limit, 1, "limit did not fall on errors");
+      standin.send({ stats: true });
+      standin.send({ reject: false });
+    },
+    function () {
+      after = report("after errors");
+      assert.ok(after.limit > failing.limit, "limit did not recover");
+      console.log("concurrency: " + connections[0] +
+        " connections open at limit " + failing.limit);
+      assert.ok(connections[0] <= 2, "idle connections were kept open");
+      standin.send({ reject: "permanent" });
+      permanent = true;
+    },
+    // 5xx replies and messages without recipients say nothing about load.
+    function () {
+      var rejected = report("permanent failures");
+      assert.ok(rejected.limit >= after.limit,
+        "limit fell on permanent failures");
+      running = false;
+    }
+  ];
+
+  if (defaultPool) {
+    // Only 4 submissions can run at once, and one thread is left for other
+    // work.
+    steps = [
+      function () {
+        report("warm up");
+        peak = 0;
+      },
+      function () {
+        report("default pool");
+        console.log("concurrency: default pool: peak limit " + peak);
+        assert.ok(peak >= 2 && peak <= 3, "limit ignored the pool size");
+        running = false;
+      }
+    ];
+  }
+
+  function next () {
+    steps.shift()();
+    if (steps.length > 0) {
+      setTimeout(next, phase);
+      return;
+    }
+
+    var wait = setInterval(function () {
+      var c = cn.concurrency();
+      if (c.inFlight > 0 || c.queued > 0) {
+        return;
+      }
+      clearInterval(wait);
+      console.log("concurrency: " + submitted + " submitted, " + failed +
+        " failed, mean latency " +
+        (latencies / (submitted + failed)).toFixed(1) + " ms");
+      standin.kill();
+
+      if (defaultPool) {
+        return;
+      }
+
+      var env = {};
+      Object.keys(process.env).forEach(function (k) {
+        if (k !== "UV_THREADPOOL_SIZE") {
+          env[k] = process.env[k];
+        }
+      });
+      child_process.fork(__filename, [ seconds, "--default-pool" ],
+        { env: env }).on('exit', function (code) {
+        assert.equal(code, 0);
+        console.log("concurrency: ok");
+      });
+    }, 10);
+  }
+
+  // Arguments are checked.
+  assert.throws(function () { cn.submitAsync(msg); });
+  [ {}, new pmta.Recipient("jane@domain.tld"), cn ].forEach(function (m) {
+    assert.throws(function () { cn.submitAsync(m, done); }, TypeError);
+    assert.throws(function () { cn.submit(m); }, TypeError);
+  });
+  assert.equal(cn.concurrency().queued, 0);
+
+  [ { backoff: 0 }, { backoff: 1 }, { backoff: -0.5 }, { tolerance: 0.5 },
+    { max: Infinity }, { min: NaN }, { initial: "8" } ].forEach(function (c) {
+    assert.throws(function () {
+      new pmta.Connection("127.0.0.1", port, undefined, undefined,
+        { transport: pmta.PmtaTransportSMTP, concurrency: c });
+    }, JSON.stringify(c));
+  });
+
+  fill();
+  setTimeout(next, phase);
+}
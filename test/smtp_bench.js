@@ -0,0 +1,112 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Using this benchmark
+ *
+ * Submits the same merge and non-merge messages through each available
+ * transport to a local stand-in SMTP server (smtp_standin.js) and reports
+ * messages per second. The "api" transport is only measured when the module
+ * was built with libpmta.
+ *
+ *   cd test
+ *   node smtp_bench [messages] [recipients per message]
+ */
+var child_process = require('child_process');
+var path          = require('path');
+var pmta          = require('../index.js');
+
+var count      = parseInt(process.argv[2] || "2000", 10);
+var recipients = parseInt(process.argv[3] || "10", 10);
+
+var payload = [
+  "From: [*from]",
+  "To: <[*to]>",
+  "Subject: PMTA benchmark",
+  "MIME-Version: 1.0",
+  "Content-Type: text/plain; charset=utf-8",
+  "Content-Transfer-Encoding: 7bit",
+  "",
+  new Array(80).join("Lorem ipsum dolor sit amet, consectetur adipiscing.\n")
+].join("\n");
+
+function build (merge) {
+  var msg = new pmta.Message("bench@domain.tld");
+  for (var r = 0; r < recipients; r++) {
+    var rcpt = new pmta.Recipient("rcpt" + r + "@domain.tld");
+    if (merge) {
+      rcpt.defineVariable("*parts", "1");
+      rcpt.defineVariable("to", "rcpt" + r + "@domain.tld");
+    }
+    msg.addRecipient(rcpt);
+  }
+  msg.addDateHeader();
+  if (merge) {
+    msg.addMergeData(payload, payload.length);
+  } else {
+    msg.addData(payload, payload.length);
+  }
+  msg.setVirtualMta("default");
+  msg.setJobId("bench");
+  return msg;
+}
+
+function run (name, port, transport, merge) {
+  var cn;
+  try {
+    cn = new pmta.Connection("127.0.0.1", port, undefined, undefined,
+      { transport: transport });
+  } catch (e) {
+    console.log(name + ": skipped (" + e.message + ")");
+    return;
+  }
+
+  var msg   = build(merge);
+  var start = process.hrtime();
+  for (var i = 0; i < count; i++) {
+    var res = cn.submit(msg);
+    if (!res.submitted) {
+      console.log(name + ": failed: " + res.errorMessage);
+      return;
+    }
+  }
+  var t    = process.hrtime(start);
+  var secs = t[0] + t[1] / 1e9;
+  console.log(name + ": " + count + " messages in " + secs.toFixed(3) +
+    "s, " + Math.round(count / secs) + " msg/s");
+}
+
+function standin (args, done) {
+  var child = child_process.fork(path.join(__dirname, "smtp_standin.js"),
+    [ "0" ].concat(args));
+  child.on('message', function (m) {
+    if (m.listening) {
+      done(child, m.listening);
+    }
+  });
+}
+
+standin([], function (child, port) {
+  standin([ "--plain" ], function (plainChild, plainPort) {
+    [ false, true ].forEach(function (merge) {
+      var kind = merge ? "merge" : "plain";
+      run("api  " + kind, port, pmta.PmtaTransportAPI, merge);
+      run("smtp " + kind, port, pmta.PmtaTransportSMTP, merge);
+      run("smtp " + kind + " (no PIPELINING/CHUNKING)", plainPort,
+        pmta.PmtaTransportSMTP, merge);
+    });
+    child.disconnect();
+    plainChild.disconnect();
+  });
+});
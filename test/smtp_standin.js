@@ -0,0 +1,321 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A stand-in for the PMTA SMTP listener
+ *
+ * Accepts everything and delivers nothing. It understands the commands the
+ * "smtp" transport sends (PIPELINING, BDAT, XMRG, XDFN, XPRT) and can add a
+ * fixed delay before acknowledging each message, so it can be used to
+ * benchmark or exercise the module without a PMTA installation. It records
+ * the most recent transactions, so tests can check what was sent.
+ *
+ *   node smtp_standin [port] [--latency ms] [--plain] [--drop n]
+ *     [--refuse address]...
+ *
+ * --plain stops it advertising PIPELINING and CHUNKING. --drop closes each
+ * connection after it has carried n messages, the way PMTA ends sessions
+ * that have been open too long. --refuse answers RCPT for that address with
+ * a 550.
+ *
+ * When forked, it sends { listening: port } to its parent once ready and
+ * accepts these messages while running:
+ *
+ *   { latency: ms }              change the delay
+ *   { reject: true|false }       temporarily fail every message, or stop
+ *   { reject: "permanent" }      permanently fail every message
+ *   { drop: n }                  change --drop
+ *   { refuse: [ address ] }      replace the --refuse list
+ *   { stats: true }              replies { messages: n, connections: n }
+ *                                with the connections currently open
+ *   { transactions: true }       replies { transactions: [ ... ] } with the
+ *                                transactions completed since the last
+ *                                request, and forgets them
+ *
+ * Each transaction is { commands, bodies, accepted }: the command lines from
+ * MAIL/XMRG on, the bytes received after each DATA/XPRT (as sent, dot-
+ * stuffing included, without the final ".") or in BDAT chunks, and whether
+ * the message was accepted.
+ */
+var net = require('net');
+
+var port    = 2526;
+var latency = 0;
+var plain   = false;
+var reject  = false;
+var drop    = 0;
+var refused = {};
+
+var recorded = [];    // completed transactions, oldest first
+var kept     = 100;   // how many of them are kept
+
+for (var a = 2; a < process.argv.length; a++) {
+  if (process.argv[a] === "--latency") {
+    latency = parseInt(process.argv[++a], 10);
+  } else if (process.argv[a] === "--drop") {
+    drop = parseInt(process.argv[++a], 10);
+  } else if (process.argv[a] === "--refuse") {
+    refused[process.argv[++a].toLowerCase()] = true;
+  } else if (process.argv[a] === "--plain") {
+    plain = true;
+  } else {
+    port = parseInt(process.argv[a], 10);
+  }
+}
+
+var messages    = 0;
+var connections = 0;
+
+var server = net.createServer(function (socket) {
+  var buffer  = Buffer.alloc(0);
+  var bdat    = 0;      // BDAT bytes still to be read
+  var data    = false;  // reading a dot-terminated DATA/XPRT body
+  var last    = false;  // current BDAT chunk is the LAST one
+  var queue   = [];
+  var waiting = false;
+  var carried = 0;      // messages accepted on this connection
+  var closed  = false;
+  var current = null;   // transaction being recorded
+
+  // Replies go out in command order, batched into one write, with the
+  // configured latency only holding back the ones that acknowledge a
+  // message.
+  function pump () {
+    var out = "";
+    while (queue.length > 0 && !waiting) {
+      var r = queue.shift();
+      if (r.delay > 0) {
+        waiting = true;
+        setTimeout(function (line) {
+          waiting = false;
+          queue.unshift({ line: line, delay: 0 });
+          pump();
+        }, r.delay, r.line);
+        break;
+      }
+      if (r.line === null) {
+        socket.end(out);
+        closed = true;
+        return;
+      }
+      out += r.line + "\r\n";
+    }
+    if (out.length > 0 && !socket.destroyed) {
+      socket.write(out);
+    }
+  }
+
+  function reply (line, delay) {
+    queue.push({ line: line, delay: delay || 0 });
+  }
+
+  function record (line) {
+    if (current !== null) {
+      current.commands.push(line);
+    }
+  }
+
+  function body (bytes) {
+    if (current !== null) {
+      if (current.bodies.length === 0) {
+        current.bodies.push("");
+      }
+      current.bodies[current.bodies.length - 1] += bytes;
+    }
+  }
+
+  function accepted () {
+    if (current !== null) {
+      current.accepted = !reject;
+      recorded.push(current);
+      if (recorded.length > kept) {
+        recorded.shift();
+      }
+      current = null;
+    }
+    if (reject) {
+      reply(reject === "permanent" ? "554 5.7.1 rejected" :
+        "451 4.3.0 try again later", latency);
+      return;
+    }
+    messages++;
+    reply("250 2.0.0 ok", latency);
+    if (drop > 0 && ++carried % drop === 0) {
+      reply(null);
+    }
+  }
+
+  function command (line) {
+    var verb = line.split(" ")[0].toUpperCase();
+
+    switch (verb) {
+      case "EHLO":
+        var caps = [ "8BITMIME", "DSN", "AUTH PLAIN", "XACK" ];
+        if (!plain) {
+          caps.unshift("PIPELINING", "CHUNKING");
+        }
+        reply("250-standin");
+        for (var i = 0; i < caps.length - 1; i++) {
+          reply("250-" + caps[i]);
+        }
+        reply("250 " + caps[caps.length - 1]);
+        break;
+      case "MAIL":
+      case "XMRG":
+        current = { commands: [ line ], bodies: [], accepted: false };
+        reply("250 ok");
+        break;
+      case "RCPT":
+        record(line);
+        var address = /<([^>]*)>/.exec(line);
+        if (address && refused[address[1].toLowerCase()]) {
+          reply("550 5.1.1 user unknown");
+        } else {
+          reply("250 ok");
+        }
+        break;
+      case "XDFN":
+        record(line);
+        reply("250 ok");
+        break;
+      case "RSET":
+        current = null;
+        reply("250 ok");
+        break;
+      case "HELO":
+      case "NOOP":
+        reply("250 ok");
+        break;
+      case "AUTH":
+        reply("235 ok");
+        break;
+      case "DATA":
+      case "XPRT":
+        record(line);
+        if (current !== null) {
+          current.bodies.push("");
+        }
+        data = true;
+        last = verb === "DATA" || / LAST$/i.test(line);
+        reply("354 go ahead");
+        break;
+      case "BDAT":
+        record(line);
+        bdat = parseInt(line.split(" ")[1], 10);
+        last = / LAST$/i.test(line);
+        break;
+      case "QUIT":
+        reply("221 bye");
+        reply(null);
+        break;
+      default:
+        reply("500 unrecognized command");
+    }
+  }
+
+  socket.on('data', function (chunk) {
+    if (closed) {
+      return;
+    }
+    buffer = Buffer.concat([ buffer, chunk ]);
+
+    for (;;) {
+      if (bdat > 0) {
+        var take = Math.min(bdat, buffer.length);
+        body(buffer.toString('latin1', 0, take));
+        buffer = buffer.slice(take);
+        bdat  -= take;
+        if (bdat > 0) {
+          break;
+        }
+        if (last) {
+          accepted();
+        } else {
+          reply("250 ok");
+        }
+        continue;
+      }
+
+      var eol = buffer.indexOf("\r\n");
+      if (eol < 0) {
+        break;
+      }
+      var line = buffer.toString('latin1', 0, eol);
+      buffer = buffer.slice(eol + 2);
+
+      if (data) {
+        if (line === ".") {
+          data = false;
+          if (last) {
+            accepted();
+          } else {
+            reply("250 ok");
+          }
+        } else {
+          body(line + "\r\n");
+        }
+        continue;
+      }
+
+      command(line);
+    }
+    pump();
+  });
+
+  connections++;
+  socket.on('close', function () {
+    connections--;
+  });
+  socket.setNoDelay(true);
+  socket.on('error', function () {});
+  reply("220 standin ESMTP");
+  pump();
+});
+
+server.listen(port, "127.0.0.1", function () {
+  if (process.send) {
+    process.send({ listening: server.address().port });
+  } else {
+    console.log("listening on " + server.address().port);
+  }
+});
+
+process.on('message', function (m) {
+  if (typeof m.latency === "number") {
+    latency = m.latency;
+  }
+  if (typeof m.reject === "boolean" || m.reject === "permanent") {
+    reject = m.reject;
+  }
+  if (typeof m.drop === "number") {
+    drop = m.drop;
+  }
+  if (m.refuse) {
+    refused = {};
+    m.refuse.forEach(function (address) {
+      refused[address.toLowerCase()] = true;
+    });
+  }
+  if (m.stats) {
+    process.send({ messages: messages, connections: connections });
+  }
+  if (m.transactions) {
+    process.send({ transactions: recorded });
+    recorded = [];
+  }
+});
+
+process.on('disconnect', function () {
+  process.exit(0);
+});
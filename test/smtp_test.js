@@ -0,0 +1,240 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Using this test script
+ *
+ * Submits through the "smtp" transport to a stand-in SMTP server
+ * (smtp_standin.js) and checks what arrives on the wire: the envelope and
+ * its DSN parameters, BDAT lengths, dot-stuffing, XDFN quoting and the
+ * recipients the server refused, with and without PIPELINING/CHUNKING and
+ * for merge messages, and that line breaks in envelope fields are refused
+ * rather than sent. It then checks that a connection the server closes
+ * after every message is reopened and the message retried instead of
+ * failing. No PMTA installation is needed.
+ *
+ *   cd test
+ *   node smtp_test
+ */
+var assert        = require('assert');
+var child_process = require('child_process');
+var path          = require('path');
+var pmta          = require('../index.js');
+
+var body     = "Subject: wire\n\n.leading dot\nline two\r\nend";
+var expected = "x-virtual-mta: vmta1\r\nx-job: job1\r\n" +
+  "Subject: wire\r\n\r\n.leading dot\r\nline two\r\nend\r\n";
+
+function standin (args, done) {
+  var child = child_process.fork(path.join(__dirname, "smtp_standin.js"),
+    [ "0" ].concat(args));
+  child.on('message', function (m) {
+    if (m.listening) {
+      done(child, m.listening);
+    }
+  });
+}
+
+// Sends a request to the stand-in and hands its answer to done.
+function ask (child, request, key, done) {
+  child.on('message', function answer (m) {
+    if (m[key] !== undefined) {
+      child.removeListener('message', answer);
+      done(m[key]);
+    }
+  });
+  child.send(request);
+}
+
+function connect (port) {
+  return new pmta.Connection("127.0.0.1", port, undefined, undefined,
+    { transport: pmta.PmtaTransportSMTP, timeout: 3 });
+}
+
+function plainMessage () {
+  var msg = new pmta.Message("sender@domain.tld");
+  msg.setVerp(true);
+  msg.setEnvelopeId("env 1+");
+  msg.setReturnType(pmta.PmtaMsgRETURN_HEADERS);
+  msg.setJobId("job1");
+  msg.setVirtualMta("vmta1");
+
+  var jane = new pmta.Recipient("jane@domain.tld");
+  jane.setNotify(pmta.PmtaRcptNOTIFY_SUCCESS | pmta.PmtaRcptNOTIFY_FAILURE);
+  msg.addRecipient(jane);
+  msg.addRecipient(new pmta.Recipient("refused@domain.tld"));
+  msg.addData(body, body.length);
+  return msg;
+}
+
+function mergeMessage () {
+  var data = "Subject: [name]\n\n.dot [name]\n";
+  var msg  = new pmta.Message("sender@domain.tld");
+  var rcpt = new pmta.Recipient("jane@domain.tld");
+  rcpt.defineVariable("*parts", "1");
+  rcpt.defineVariable("name", "Jo \"J\" \\x");
+  msg.addRecipient(rcpt);
+  msg.addMergeData(data, data.length);
+  return msg;
+}
+
+function checkRefused (name, res) {
+  assert.ok(res.submitted, name + ": " + res.errorMessage);
+  assert.deepEqual(res.rejectedRecipients,
+    [ "refused@domain.tld: 550 5.1.1 user unknown" ]);
+}
+
+var envelope = [
+  "MAIL FROM:<sender@domain.tld> VERP RET=HDRS ENVID=env+201+2B",
+  "RCPT TO:<jane@domain.tld> NOTIFY=SUCCESS,FAILURE",
+  "RCPT TO:<refused@domain.tld>"
+];
+
+var merged = [
+  "XMRG FROM:<sender@domain.tld>",
+  "XDFN *parts=\"1\" name=\"Jo \\\"J\\\" \\\\x\"",
+  "RCPT TO:<jane@domain.tld>",
+  "XPRT 1 LAST"
+];
+
+// PIPELINING and CHUNKING: the body goes out as is, in one BDAT.
+function pipelined (next) {
+  standin([ "--refuse", "refused@domain.tld" ], function (child, port) {
+    var cn = connect(port);
+    checkRefused("pipelined", cn.submit(plainMessage()));
+
+    // Only NEVER or combinations of the three DSN conditions.
+    var rcpt = new pmta.Recipient("jane@domain.tld");
+    [ 8, -1, 1.5, 0x0f, NaN ].forEach(function (notify) {
+      assert.throws(function () { rcpt.setNotify(notify); }, TypeError);
+    });
+    rcpt.setNotify(pmta.PmtaRcptNOTIFY_SUCCESS | pmta.PmtaRcptNOTIFY_DELAY);
+    rcpt.setNotify(pmta.PmtaRcptNOTIFY_NEVER);
+    assert.ok(cn.submit(mergeMessage()).submitted);
+
+    ask(child, { transactions: true }, "transactions", function (t) {
+      assert.equal(t.length, 2);
+      assert.deepEqual(t[0].commands, envelope.concat(
+        [ "BDAT " + expected.length + " LAST" ]));
+      assert.deepEqual(t[0].bodies, [ expected ]);
+      assert.ok(t[0].accepted);
+
+      assert.deepEqual(t[1].commands, merged);
+      assert.deepEqual(t[1].bodies,
+        [ "Subject: [name]\r\n\r\n..dot [name]\r\n" ]);
+
+      console.log("smtp: pipelined: ok");
+      child.disconnect();
+      next();
+    });
+  });
+}
+
+// Neither: one command at a time and a dot-stuffed DATA body.
+function lockstep (next) {
+  standin([ "--plain", "--refuse", "refused@domain.tld" ],
+    function (child, port) {
+    var cn = connect(port);
+    checkRefused("lockstep", cn.submit(plainMessage()));
+
+    ask(child, { transactions: true }, "transactions", function (t) {
+      assert.equal(t.length, 1);
+      assert.deepEqual(t[0].commands, envelope.concat([ "DATA" ]));
+      assert.deepEqual(t[0].bodies,
+        [ expected.replace("\r\n.leading", "\r\n..leading") ]);
+
+      console.log("smtp: lockstep: ok");
+      child.disconnect();
+      next();
+    });
+  });
+}
+
+// Line breaks in envelope fields are refused before anything is sent, and
+// the connection stays usable.
+function injection (next) {
+  standin([], function (child, port) {
+    var cn     = connect(port);
+    var inject = "x\r\nRCPT TO:<injected@evil.tld>";
+
+    var msg  = mergeMessage();
+    var rcpt = new pmta.Recipient("joe@domain.tld");
+    rcpt.defineVariable("name", inject);
+    msg.addRecipient(rcpt);
+    var res = cn.submit(msg);
+    assert.ok(!res.submitted);
+    assert.ok(/variable value/.test(res.errorMessage), res.errorMessage);
+
+    msg = plainMessage();
+    msg.setVirtualMta("vmta1\n" + inject);
+    res = cn.submit(msg);
+    assert.ok(!res.submitted);
+    assert.ok(/virtual MTA/.test(res.errorMessage), res.errorMessage);
+
+    msg = plainMessage();
+    msg.setJobId("job1\r\n\r\nInjected: body");
+    res = cn.submit(msg);
+    assert.ok(!res.submitted);
+    assert.ok(/job id/.test(res.errorMessage), res.errorMessage);
+
+    assert.ok(cn.submit(plainMessage()).submitted);
+
+    ask(child, { transactions: true }, "transactions", function (t) {
+      assert.equal(t.length, 1);
+      assert.deepEqual(t[0].commands.slice(0, 3), envelope);
+      console.log("smtp: injection: ok");
+      child.disconnect();
+      next();
+    });
+  });
+}
+
+// The server closes the connection after every message; each submission
+// after the first must be retried on a new one rather than fail.
+function reconnect (name, args, next) {
+  standin([ "--drop", "1" ].concat(args), function (child, port) {
+    var cn  = connect(port);
+    var msg = new pmta.Message("test@domain.tld");
+    msg.addRecipient(new pmta.Recipient("jane@domain.tld"));
+    msg.addData(body, body.length);
+
+    for (var i = 0; i < 5; i++) {
+      var start = Date.now();
+      var res   = cn.submit(msg);
+      assert.ok(res.submitted, name + ": submit " + i + ": " +
+        res.errorMessage);
+      assert.ok(Date.now() - start < 1000, name + ": submit " + i +
+        " waited for the timeout");
+    }
+
+    ask(child, { stats: true }, "messages", function (messages) {
+      assert.equal(messages, 5);
+      console.log("smtp: reconnect " + name + ": ok");
+      child.disconnect();
+      next();
+    });
+  });
+}
+
+pipelined(function () {
+  lockstep(function () {
+    injection(function () {
+      reconnect("pipelined", [], function () {
+        reconnect("lockstep", [ "--plain" ], function () {
+          console.log("smtp: ok");
+        });
+      });
+    });
+  });
+});
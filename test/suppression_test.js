@@ -0,0 +1,104 @@
+/* Copyright (C) 2015  Dan Nielsen <dnielsen@reachmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Using this test script
+ *
+ * Builds a suppression index in the system temp directory, checks lookups
+ * and recipient filtering, and times lookups against an index of
+ * `size` addresses. No PMTA installation is needed.
+ *
+ *   cd test
+ *   node suppression_test [size]
+ */
+var assert = require('assert');
+var fs     = require('fs');
+var os     = require('os');
+var path   = require('path');
+var pmta   = require('../index.js');
+
+var size = parseInt(process.argv[2] || "1000000", 10);
+var file = path.join(os.tmpdir(), "pmta-suppress-" + process.pid + ".idx");
+var list = path.join(os.tmpdir(), "pmta-suppress-" + process.pid + ".txt");
+
+// Building from an array; case and surrounding white space do not matter.
+assert.equal(pmta.SuppressionIndex.build(
+  [ "bounced@domain.tld", " Complained@Domain.TLD ", "bounced@domain.tld" ],
+  file), 2);
+
+var index = new pmta.SuppressionIndex(file);
+assert.equal(index.size(), 2);
+assert.ok(index.has("bounced@domain.tld"));
+assert.ok(index.has("COMPLAINED@domain.tld"));
+assert.ok(!index.has("jane@domain.tld"));
+
+// Filtering on add.
+var msg = new pmta.Message("noreply@domain.tld");
+assert.strictEqual(msg.addRecipient(new pmta.Recipient("jane@domain.tld"),
+  index), true);
+assert.strictEqual(msg.addRecipient(new pmta.Recipient("bounced@domain.tld"),
+  index), false);
+assert.strictEqual(msg.addRecipients([
+  new pmta.Recipient("joe@domain.tld"),
+  new pmta.Recipient("complained@domain.tld"),
+  new pmta.Recipient("bounced@domain.tld")
+], index), 1);
+assert.equal(msg.suppressedCount(), 3);
+
+// Anything but a Recipient is refused, and a bad element in an array leaves
+// the message as it was.
+assert.throws(function () { msg.addRecipient({ to: "jane@domain.tld" }); },
+  TypeError);
+assert.throws(function () {
+  msg.addRecipients([ new pmta.Recipient("bounced@domain.tld"),
+    { to: "jane@domain.tld" } ], index);
+}, TypeError);
+assert.equal(msg.suppressedCount(), 3);
+
+// Without an index nothing is dropped.
+assert.strictEqual(msg.addRecipient(new pmta.Recipient("bounced@domain.tld")),
+  true);
+assert.equal(msg.suppressedCount(), 3);
+
+// Building from a file, one address per line, and lookup timing.
+var lines = [ "# unsubscribes" ];
+for (var i = 0; i < size; i++) {
+  lines.push("user" + (i * 2) + "@domain.tld");
+  if (lines.length === 10000) {
+    fs.appendFileSync(list, lines.join("\n") + "\n");
+    lines = [];
+  }
+}
+fs.appendFileSync(list, lines.join("\n") + "\n");
+
+assert.equal(pmta.SuppressionIndex.build(list, file), size);
+index = new pmta.SuppressionIndex(file);
+assert.equal(index.size(), size);
+
+var lookups = 1000000;
+var hits    = 0;
+var start   = process.hrtime();
+for (var j = 0; j < lookups; j++) {
+  if (index.has("user" + ((j * 7919) % (2 * size)) + "@domain.tld")) {
+    hits++;
+  }
+}
+var t = process.hrtime(start);
+assert.equal(hits, lookups / 2);
+console.log("suppression: " + size + " addresses, " +
+  Math.round((t[0] * 1e9 + t[1]) / lookups) + " ns per lookup");
+
+fs.unlinkSync(list);
+fs.unlinkSync(file);
+console.log("suppression: ok");